@@ -0,0 +1,120 @@
+;;; -*- Mode: Scheme; Character-encoding: utf-8; -*-
+;;; Copyright (C) 2005-2020 beingmeta, inc.  All rights reserved.
+
+;;; Behavior checks for the ziptools module. This builds small archives
+;;; under CHECKDIR, exercising dedup, appending commits, zip/verify,
+;;; zipstreams and zip/extract-all, reads them back, and reports each
+;;; failed check. It exits with a non-zero status if any check fails.
+
+(use-module '{ziptools texttools logger})
+
+(define checkdir (config 'checkdir (glom "/tmp/zipcheck-" (getpid))))
+
+(define n-checks 0)
+(define failures '())
+
+(define (check name ok)
+  (set! n-checks (1+ n-checks))
+  (unless ok
+    (lineout "FAILED\t" name)
+    (set! failures (cons name failures))))
+
+(define (check-path name) (mkpath checkdir name))
+
+(define (fresh-path name)
+  (let ((path (check-path name)))
+    (when (file-exists? path) (remove-file path))
+    path))
+
+(define (text-content i)
+  (glom "Entry " i " of the check archive, with some repeated text.\n"
+    "Entry " i " of the check archive, with some repeated text.\n"))
+
+(define (verified? zf)
+  (let ((result (zip/verify zf)))
+    (and (zero? (get result 'failed)) (fail? (get result 'errors)))))
+
+;;; Building, dedup and reading back
+
+(define (check-roundtrip)
+  (let* ((path (fresh-path "roundtrip.zip"))
+	 (zf (zip/open path [create #t dedup #t]))
+	 (same (text-content "shared")))
+    (dotimes (i 20) (zip/add! zf (glom "text/" i) (text-content i)))
+    (dotimes (i 5) (zip/add! zf (glom "same/" i) same))
+    (zip/add! zf "stored.bin" (random-packet 4096) #f #f)
+    (zip/commit! zf)
+    (check "dedup skipped compressing copies"
+	   (>= (get (zip/stats zf) 'dedups) 4))
+    (let ((zf (zip/open path [readonly #t])))
+      (check "roundtrip verifies" (verified? zf))
+      (check "roundtrip entry count"
+	     (= (get (zip/verify zf) 'entries) 26))
+      (check "roundtrip text" (equal? (zip/get zf "text/7") (text-content 7)))
+      (check "roundtrip dedup content"
+	     (equal? (zip/get zf "same/3") same))
+      (check "roundtrip stored size"
+	     (= (length (zip/get zf "stored.bin" #t)) 4096))
+      (check "roundtrip missing entry" (not (zip/get zf "nothing")))
+      (zip/close! zf))
+    path))
+
+;;; Appending commits
+
+(define (check-append path)
+  (let ((zf (zip/open path [append #t])))
+    (zip/add! zf "appended/1" (text-content "appended") "a comment")
+    (zip/add! zf "appended/2" (random-packet 1000) #f #f)
+    (zip/commit! zf))
+  (let ((zf (zip/open path [readonly #t])))
+    (check "append verifies" (verified? zf))
+    (check "append keeps old entries"
+	   (equal? (zip/get zf "text/3") (text-content 3)))
+    (check "append adds new entries"
+	   (equal? (zip/get zf "appended/1") (text-content "appended")))
+    (check "append stored size"
+	   (= (length (zip/get zf "appended/2" #t)) 1000))
+    (zip/close! zf)))
+
+;;; Zipstreams
+
+(define (check-streams path)
+  (let* ((zf (zip/open path [readonly #t]))
+	 (stream (zip/open-entry zf "text/5"))
+	 (bytes 0)
+	 (chunk (zip/read stream 16)))
+    (while (packet? chunk)
+      (set! bytes (+ bytes (length chunk)))
+      (set! chunk (zip/read stream 16)))
+    (zip/close-entry! stream)
+    (check "stream reads the whole entry"
+	   (= bytes (length (text-content 5))))
+    (zip/close! zf)))
+
+;;; Extracting
+
+(define (check-extract)
+  (let* ((path (fresh-path "unsafe.zip"))
+	 (dest (check-path "extracted"))
+	 (zf (zip/make path)))
+    (zip/add! zf "ok/file.txt" "fine")
+    (zip/add! zf "../escaped.txt" "not fine")
+    (zip/commit! zf)
+    (let* ((zf (zip/open path [readonly #t]))
+	   (result (zip/extract-all zf dest)))
+      (check "extract writes safe entries"
+	     (equal? (filestring (mkpath dest "ok/file.txt")) "fine"))
+      (check "extract reports unsafe names"
+	     (test (get result 'errors) "../escaped.txt"))
+      (check "extract doesn't escape"
+	     (not (file-exists? (check-path "escaped.txt"))))
+      (zip/close! zf))))
+
+(define (main)
+  (unless (file-directory? checkdir) (mkdirs checkdir))
+  (let ((path (check-roundtrip)))
+    (check-append path)
+    (check-streams path))
+  (check-extract)
+  (lineout n-checks " checks, " (length failures) " failed")
+  (unless (null? failures) (exit 1)))
@@ -0,0 +1,122 @@
+;;; -*- Mode: Scheme; Character-encoding: utf-8; -*-
+;;; Copyright (C) 2005-2020 beingmeta, inc.  All rights reserved.
+
+;;; Benchmarks for the ziptools module. This generates synthetic
+;;; archives under BENCHDIR and writes one tab-separated line per
+;;; measurement (benchmark, archive, threads, value, unit) to stdout
+;;; and, if BENCHOUT is set, to that file, so that runs can be
+;;; compared.
+
+(use-module '{ziptools texttools logger})
+
+(define benchdir (config 'benchdir (glom "/tmp/zipbench-" (getpid))))
+(define benchout (config 'benchout #f))
+(define max-threads (config 'benchthreads 4))
+(define n-small (config 'benchsmall 20000))
+(define n-huge (config 'benchhuge 4))
+(define huge-size (config 'benchhugesize (* 64 1024 1024)))
+(define n-lookups (config 'benchlookups 100000))
+
+(define results '())
+
+(define (report bench archive threads value unit)
+  (let ((line (glom bench "\t" archive "\t" threads "\t" value "\t" unit)))
+    (lineout line)
+    (set! results (cons line results))))
+
+(define (text-content size)
+  (let ((line "The quick brown fox jumps over the lazy dog, entry text.\n"))
+    (let ((reps (1+ (quotient size (length line)))))
+      (slice (apply glom (make-list reps line)) 0 size))))
+
+(define (binary-content size) (random-packet size))
+
+(define (peak-rss)
+  (let ((status (filestring "/proc/self/status")))
+    (try (for-choices (line (elts (segment status "\n")))
+	   (tryif (has-prefix line "VmHWM:")
+	     (string->number (car (segment (trim-spaces (slice line 6)) " ")))))
+	 #f)))
+
+(define (entry-name i) (glom "dir" (quotient i 1000) "/entry" i ".dat"))
+
+;;; Building archives
+
+(define (build-archive name count size binary compress)
+  (let* ((path (mkpath benchdir (glom name ".zip")))
+	 (content (if binary (binary-content size) (text-content size)))
+	 (zf (zip/make path))
+	 (start (elapsed-time)))
+    (dotimes (i count)
+      (zip/add! zf (entry-name i) content #f compress))
+    (zip/commit! zf)
+    (let ((secs (elapsed-time start)))
+      (report "add+commit" name 1 (/~ count secs) "entries/s")
+      (report "add+commit" name 1 (/~ (* count size) (* secs 1024 1024)) "MB/s"))
+    path))
+
+;;; Reading archives
+
+(define (read-slice zf names totals k)
+  (let ((bytes 0))
+    (doseq (name names)
+      (set! bytes (+ bytes (length (zip/get zf name #t)))))
+    (vector-set! totals k bytes)))
+
+(define (get-throughput name path count threads)
+  (let* ((zf (zip/open path [readonly #t readers threads]))
+	 (names (make-vector count #f))
+	 (totals (make-vector threads 0))
+	 (workers {}))
+    (dotimes (i count) (vector-set! names i (entry-name i)))
+    (let ((chunk (1+ (quotient count threads)))
+	  (start (elapsed-time))
+	  (bytes 0))
+      (dotimes (k threads)
+	(set+! workers
+	       (thread/call read-slice zf
+			    (slice names (min count (* k chunk))
+				   (min count (* (1+ k) chunk)))
+			    totals k)))
+      (thread/join workers)
+      (let ((secs (elapsed-time start)))
+	(doseq (total totals) (set! bytes (+ bytes total)))
+	(report "get" name threads (/~ count secs) "entries/s")
+	(report "get" name threads (/~ bytes (* secs 1024 1024)) "MB/s")))
+    (zip/close! zf)))
+
+(define (lookup-latency name path count)
+  (let ((zf (zip/open path [readonly #t]))
+	(start (elapsed-time)))
+    (dotimes (i n-lookups)
+      (zip/exists? zf (entry-name (random count))))
+    (report "lookup" name 1
+	    (/~ (* (elapsed-time start) 1000000000) n-lookups) "ns")
+    (zip/close! zf)))
+
+(define (thread-counts)
+  (let ((counts '()) (n 1))
+    (while (< n max-threads)
+      (set! counts (cons n counts))
+      (set! n (* n 2)))
+    (reverse (cons max-threads counts))))
+
+(define (bench-archive name count size binary compress)
+  (let ((path (build-archive name count size binary compress)))
+    (doseq (threads (thread-counts))
+      (get-throughput name path count threads))
+    (lookup-latency name path count)
+    (remove-file path)))
+
+(define (main)
+  (unless (file-directory? benchdir) (mkdirs benchdir))
+  (bench-archive "small-text-deflate" n-small 2048 #f #t)
+  (bench-archive "small-text-stored" n-small 2048 #f #f)
+  (bench-archive "small-binary-deflate" n-small 2048 #t #t)
+  (bench-archive "small-binary-stored" n-small 2048 #t #f)
+  (bench-archive "huge-text-deflate" n-huge huge-size #f #t)
+  (bench-archive "huge-binary-stored" n-huge huge-size #t #f)
+  (report "peak-rss" "all" 1 (peak-rss) "kB")
+  (when benchout
+    (fileout benchout
+      (doseq (line (reverse results)) (lineout line)))))
@@ -10,7 +10,7 @@
   (default! encoding  (getopt opts 'content-encoding (path->encoding path)))
   (cond ((eq? aspect 'exists?) (exists? (zipfs/info zip path)))
 	((eq? aspect 'content)
-	 (zip/get zip path (or (not ctype) (not (has-prefix ctype "text")))))
+	 (zip/get zip path (or ctype #t)))
 	((not (zip/exists? zip path)) #f)
 	(else
 	 (let* ((charset (and ctype (has-prefix ctype "text")
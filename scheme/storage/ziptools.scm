@@ -0,0 +1,179 @@
+;;; -*- Mode: Scheme; Character-encoding: utf-8; -*-
+;;; Copyright (C) 2005-2020 beingmeta, inc.  All rights reserved.
+
+(in-module 'storage/ziptools)
+
+;;; Read-mostly indexes and pools stored in zip archives. Index keys are
+;;; hashed into bucket members named index/<hash>, each holding the
+;;; dtype of a list of (key . values) pairs, where values is a choice.
+;;; The member index.dtype records the number of hash bits and the
+;;; number of keys, and index.keys holds a vector of all the keys.
+;;; Pool frames are stored as dtypes in members named pool/<offset>,
+;;; with the pool's base, capacity and load in the member pool.dtype.
+;;; Batch fetches use zip/get-many, so a prefetch reads its members in
+;;; archive order. Both are written to a temporary file which is then
+;;; renamed over the target, so readers never see a partial archive.
+
+(use-module '{ziptools})
+
+(module-export! '{zipindex/open zipindex/write!
+		  zippool/open zippool/write!})
+
+(define-init zipindex-bucket-bits 20)
+
+(define zipopen-opts [readonly #t shared #t lazy #t])
+
+(define (bucket-name key (bits zipindex-bucket-bits))
+  (let ((hash (packet->base16 (md5 (dtype->packet key)))))
+    (glom "index/" (slice hash 0 (quotient (+ bits 3) 4)))))
+
+(define (oid-name oid base)
+  (glom "pool/" (number->string (oid-offset oid base) 16)))
+
+(define (read-member zf name)
+  (let ((data (zip/get zf name #t)))
+    (and data (packet->dtype data))))
+
+(define (temp-path path) (glom path ".part"))
+
+(define (start-archive path)
+  (when (file-exists? (temp-path path)) (remove-file (temp-path path)))
+  (zip/make (temp-path path)))
+
+(define (finish-archive zf path)
+  (zip/commit! zf)
+  (move-file (temp-path path) path))
+
+;;; Indexes
+
+;;; The state of an index is a pair of its zipfile and the content of
+;;; index.dtype. Archives written before index.dtype existed use the
+;;; default number of bits and are scanned for their keys and size.
+
+(define (bucket-get bucket key)
+  (let ((entry (and bucket (assoc key bucket))))
+    (if entry (cdr entry) {})))
+
+(define (index-bits state)
+  (try (get (cdr state) 'bits) zipindex-bucket-bits))
+
+(define (zipindex-fetch index state key)
+  (bucket-get (read-member (car state) (bucket-name key (index-bits state)))
+	      key))
+
+(define (zipindex-fetchn index state keyvec)
+  (let* ((bits (index-bits state))
+	 (names (map (lambda (key) (bucket-name key bits)) keyvec))
+	 (buckets (zip/get-many (car state) names #t))
+	 (results (make-vector (length keyvec) {})))
+    (dotimes (i (length keyvec))
+      (let ((data (elt buckets i)))
+	(when data
+	  (vector-set! results i
+		       (bucket-get (packet->dtype data) (elt keyvec i))))))
+    results))
+
+(define (all-buckets zf)
+  (elts (zip/get-many zf (choice->vector (zip/list-dir zf "index/")) #t)))
+
+(define (zipindex-fetchkeys index state)
+  (if (test (cdr state) 'size)
+      (elts (read-member (car state) "index.keys"))
+      (for-choices (data (all-buckets (car state)))
+	(for-choices (entry (elts (packet->dtype data)))
+	  (car entry)))))
+
+(define (zipindex-fetchsize index state)
+  (if (test (cdr state) 'size)
+      (get (cdr state) 'size)
+      (let ((count 0))
+	(do-choices (data (all-buckets (car state)))
+	  (set! count (+ count (length (packet->dtype data)))))
+	count)))
+
+(define (zipindex/open path (opts #f))
+  "Opens the zip archive *path* as a read-only index"
+  (let* ((zf (zip/open path (getopt opts 'zipopts zipopen-opts)))
+	 (info (or (read-member zf "index.dtype") #[])))
+    (make-procindex path
+      [fetch zipindex-fetch
+       fetchn zipindex-fetchn
+       fetchkeys zipindex-fetchkeys
+       fetchsize zipindex-fetchsize
+       readonly #t]
+      (cons zf info) path)))
+
+(define (zipindex/write! path table (opts #f))
+  "Writes the keys and values of *table* into a new zip archive at *path*,
+replacing any archive already there"
+  (let* ((bits (getopt opts 'bits zipindex-bucket-bits))
+	 (keys (getkeys table))
+	 (buckets (make-hashtable))
+	 (zf (start-archive path)))
+    (do-choices (key keys)
+      (add! buckets (bucket-name key bits) (cons key (qc (get table key)))))
+    (do-choices (name (getkeys buckets))
+      (zip/add! zf name
+		(dtype->packet (choice->list (get buckets name)))
+		#f (getopt opts 'compress #t)))
+    (zip/add! zf "index.keys" (dtype->packet (choice->vector keys))
+	      #f (getopt opts 'compress #t))
+    (zip/add! zf "index.dtype"
+	      (dtype->packet [bits bits size (choice-size keys)])
+	      #f #t)
+    (finish-archive zf path)
+    (choice-size keys)))
+
+;;; Pools
+
+;;; OIDs which aren't stored come back as {}, as for other pools, since
+;;; #f is a value a frame can have.
+
+(define (zippool-fetch pool state oid)
+  (let ((data (zip/get (car state) (oid-name oid (cdr state)) #t)))
+    (if data (packet->dtype data) {})))
+
+(define (zippool-fetchn pool state oidvec)
+  (let* ((base (cdr state))
+	 (frames (zip/get-many (car state)
+			       (map (lambda (oid) (oid-name oid base)) oidvec)
+			       #t))
+	 (results (make-vector (length oidvec) {})))
+    (dotimes (i (length oidvec))
+      (let ((data (elt frames i)))
+	(when data (vector-set! results i (packet->dtype data)))))
+    results))
+
+(define (zippool-getload pool state)
+  (get (read-member (car state) "pool.dtype") 'load))
+
+(define (zippool/open path (opts #f))
+  "Opens the zip archive *path* as a read-only pool"
+  (let* ((zf (zip/open path (getopt opts 'zipopts zipopen-opts)))
+	 (info (read-member zf "pool.dtype")))
+    (unless info
+      (irritant path |NotAZipPool| zippool/open))
+    (make-procpool path (get info 'base) (get info 'capacity)
+      [fetch zippool-fetch
+       fetchn zippool-fetchn
+       getload zippool-getload
+       readonly #t]
+      (cons zf (get info 'base))
+      (get info 'load))))
+
+(define (zippool/write! path base capacity frames (opts #f))
+  "Writes *frames*, a table from OIDs (in the pool starting at *base*)
+to their values, into a new zip archive at *path*, replacing any
+archive already there"
+  (let ((zf (start-archive path))
+	(load 0))
+    (do-choices (oid (getkeys frames))
+      (let ((offset (oid-offset oid base)))
+	(when (>= offset load) (set! load (1+ offset)))
+	(zip/add! zf (oid-name oid base) (dtype->packet (get frames oid))
+		  #f (getopt opts 'compress #t))))
+    (zip/add! zf "pool.dtype"
+	      (dtype->packet [base base capacity capacity load load])
+	      #f #t)
+    (finish-archive zf path)
+    load))
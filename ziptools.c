@@ -20,27 +20,269 @@
 #include "kno/frames.h"
 #include "kno/numbers.h"
 #include "kno/cprims.h"
+#include "kno/streams.h"
 
 #include <libu8/libu8io.h>
 #include <libu8/u8pathfns.h>
 #include <libu8/u8filefns.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <zlib.h>
 #include <zip.h>
 
+#if ( (defined(__x86_64__)) && (defined(__GNUC__)) )
+#define ZIP_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define ZIP_X86_SIMD 0
+#endif
+
 static u8_condition ZipFileError=_("Zip file error");
+static u8_condition ZipFileReadOnly=_("Zip file is read-only");
+static u8_condition ZipFileFinished=
+  _("In-memory zip archive has been committed");
+static u8_condition ZipEntryTooLarge=
+  _("Zip entry too large, use zip/open-entry");
+static u8_condition ZipStreamClosed=_("Zip stream is closed");
+static u8_condition ZipBadCompression=_("Unknown zip compression method");
+static u8_condition ZipUnsupportedCompression=
+  _("Zip compression method not supported by this libzip");
+static u8_condition ZipStreamCantSeek=
+  _("Can't seek backwards in a compressed zip entry");
 
 KNO_EXPORT kno_lisp_type kno_zipfile_type;
 kno_lisp_type kno_zipfile_type;
 #define KNO_ZIPFILE_TYPE 0x4640ce0L
 
+KNO_EXPORT kno_lisp_type kno_zipstream_type;
+kno_lisp_type kno_zipstream_type;
+#define KNO_ZIPSTREAM_TYPE 0x4640ce1L
+
+#ifndef ZIP_RDONLY
+#define ZIP_RDONLY 0
+#endif
+
+/* The bundled libzip always has per-entry compression settings */
+#if ( (defined(LIBZIP_VERSION_MAJOR)) && \
+      (!(defined(HAVE_ZIP_SET_FILE_COMPRESSION))) )
+#define HAVE_ZIP_SET_FILE_COMPRESSION 1
+#endif
+
+#if ( (defined(LIBZIP_VERSION_MAJOR)) && \
+      ( (LIBZIP_VERSION_MAJOR > 1) || (LIBZIP_VERSION_MINOR >= 7) ) )
+#define HAVE_ZIP_COMPRESSION_METHOD_SUPPORTED 1
+#else
+#define HAVE_ZIP_COMPRESSION_METHOD_SUPPORTED 0
+#endif
+
+/* Read handles are separate libzip handles over the same (read-only)
+   file, so that threads reading from the same archive don't serialize
+   on zipfile_lock. */
+
+typedef struct KNO_ZIPREADER {
+  struct zip *zip;
+  struct KNO_ZIPREADER *next;} KNO_ZIPREADER;
+typedef struct KNO_ZIPREADER *kno_zipreader;
+
+/* The entry directory is a hashtable of entry metadata built when the
+   zipfile is opened, so that lookups don't go through libzip's linear
+   name search. It also keeps the entries sorted by name, so that
+   directory listings and prefix counts are binary searches. It is
+   dropped when a writable zipfile is modified and rebuilt when the
+   zipfile is reopened or listed. */
+
+typedef struct KNO_ZIPENTRY {
+  u8_string name; long long index;
+  unsigned long long size, csize;
+  time_t mtime; unsigned int crc;
+  int method, encryption;
+  long long offset;
+  struct KNO_ZIPENTRY *next;} KNO_ZIPENTRY;
+typedef struct KNO_ZIPENTRY *kno_zipentry;
+
+typedef struct KNO_ZIPDIR {
+  long long n_entries;
+  struct KNO_ZIPENTRY *entries;
+  unsigned int n_buckets;
+  struct KNO_ZIPENTRY **buckets;
+  long long n_sorted;
+  struct KNO_ZIPENTRY **sorted;} KNO_ZIPDIR;
+typedef struct KNO_ZIPDIR *kno_zipdir;
+
+/* Entry caches keep the decoded content of recently read entries,
+   up to a byte budget, evicting the least recently used. */
+
+typedef struct KNO_ZIPCACHED {
+  u8_string name; unsigned int hash;
+  lispval value; size_t size;
+  struct KNO_ZIPCACHED *hnext;
+  struct KNO_ZIPCACHED *newer, *older;} KNO_ZIPCACHED;
+typedef struct KNO_ZIPCACHED *kno_zipcached;
+
+/* Entries being read into the cache by zip/prefetch. Readers which
+   miss in the cache wait for these rather than reading them again. */
+typedef struct KNO_ZIPFETCH {
+  u8_string name; unsigned int hash;
+  struct KNO_ZIPFETCH *next;} KNO_ZIPFETCH;
+typedef struct KNO_ZIPFETCH *kno_zipfetch;
+
+typedef struct KNO_ZIPCACHE {
+  u8_mutex cache_lock;
+  size_t budget, used;
+  unsigned int n_buckets;
+  struct KNO_ZIPCACHED **buckets;
+  struct KNO_ZIPCACHED *newest, *oldest;
+  struct KNO_ZIPFETCH *inflight;
+  u8_condvar inflight_done;
+  long long n_entries, hits, misses, evictions;
+  long long prefetches, waits;} KNO_ZIPCACHE;
+typedef struct KNO_ZIPCACHE *kno_zipcache;
+
+/* Read handles on other archives whose entries have been copied into
+   a zipfile. libzip reads the copied data when the zipfile is
+   committed, so they're kept until then. */
+typedef struct KNO_ZIPDONOR {
+  u8_string filename;
+  struct zip *zip;
+  lispval packet;
+  struct KNO_ZIPDONOR *next;} KNO_ZIPDONOR;
+typedef struct KNO_ZIPDONOR *kno_zipdonor;
+
+/* Statistics are kept for each zipfile and for all zipfiles together.
+   Timings go into histograms whose bucket *i* counts durations of
+   less than 2^i nanoseconds (and at least half that). */
+
+#define ZIPSTATS_BUCKETS 40
+
+typedef struct ZIP_HISTOGRAM {
+  long long count, total;
+  long long buckets[ZIPSTATS_BUCKETS];} ZIP_HISTOGRAM;
+
+#define ZIPSTAT_LOCKWAIT 0
+#define ZIPSTAT_LOOKUP 1
+#define ZIPSTAT_DECOMPRESS 2
+#define ZIPSTAT_COMMIT 3
+#define ZIPSTAT_N_TIMERS 4
+
+typedef struct KNO_ZIPSTATS {
+  long long gets, bytes_in, bytes_out;
+  long long adds, bytes_added;
+  long long dedups, bytes_deduped;
+  long long reopens, commits;
+  struct ZIP_HISTOGRAM timers[ZIPSTAT_N_TIMERS];} KNO_ZIPSTATS;
+typedef struct KNO_ZIPSTATS *kno_zipstats;
+
 typedef struct KNO_ZIPFILE {
   KNO_CONS_HEADER;
   u8_string filename; int flags;
   u8_mutex zipfile_lock; int closed;
-  struct zip *zip;} KNO_ZIPFILE;
+  int readonly;
+  struct zip *zip;
+  int inmem; lispval packet;
+  struct zip_source *memsrc;
+  struct KNO_ZIPDIR *zipdir;
+  int lazy;
+  int commit_threads, deflate_level, autostore, dedup;
+  int append_commit, append_blocked;
+  lispval autochoices;
+  struct KNO_ZIPSRC *pending;
+  struct KNO_ZIPDONOR *donors;
+  struct KNO_ZIPSTATS stats;
+  struct KNO_ZIPCACHE *cache;
+  u8_mutex readers_lock;
+  int n_readers, max_readers;
+  struct KNO_ZIPREADER *readers;
+  int share_count;} KNO_ZIPFILE;
 typedef struct KNO_ZIPFILE *kno_zipfile;
 
+/* A zipstream reads a single entry incrementally through its own
+   handle, so it doesn't hold the zipfile's lock between reads. */
+
+typedef struct KNO_ZIPSTREAM {
+  KNO_CONS_HEADER;
+  lispval zipfile; u8_string name;
+  struct zip *zip; struct zip_file *zfile;
+  long long index;
+  unsigned long long size, pos;
+  int stored, closed;
+  u8_mutex stream_lock;} KNO_ZIPSTREAM;
+typedef struct KNO_ZIPSTREAM *kno_zipstream;
+
+static int zipfile_max_readers = 16;
+static int zipfile_commit_threads = 1;
+static ssize_t zipfile_cache_budget = 0;
+static int zipfile_autostore = 0;
+static int zipfile_dedup = 0;
+static int zipfile_stats = 1;
+static int zipfile_prefetch_threads = 2;
+static int zipfile_shared = 0;
+static struct KNO_ZIPSTATS zipstats_all;
+
+static lispval create_symbol, readonly_symbol, readers_symbol;
+static lispval text_symbol, bufsize_symbol, threads_symbol;
+static lispval cache_symbol, budget_symbol, autostore_symbol;
+static lispval store_symbol, deflate_symbol;
+static lispval prefix_symbol, glob_symbol, columns_symbol, count_symbol;
+static lispval start_symbol, limit_symbol, append_symbol, skip_symbol;
+static lispval include_symbol, exclude_symbol, shared_symbol;
+static lispval nocheck_symbol, lazy_symbol, dedup_symbol;
+
+/* Statistics */
+
+static long long zip_nanotime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (((long long)now.tv_sec)*1000000000LL)+now.tv_nsec;
+}
+
+/* Returns a start time for zipstats_timed, or 0 if stats are off */
+static long long zipstats_start()
+{
+  if (zipfile_stats) return zip_nanotime();
+  else return 0;
+}
+
+#define ZIPSTATS_COUNT(zf,field,delta)					\
+  do { if (zipfile_stats) {						\
+      __atomic_add_fetch(&((zf)->stats.field),(delta),__ATOMIC_RELAXED); \
+      __atomic_add_fetch(&(zipstats_all.field),(delta),__ATOMIC_RELAXED);}} \
+  while (0)
+
+static void zipstats_record(struct ZIP_HISTOGRAM *h,long long ns)
+{
+  int bucket = (ns<=0) ? (0) : (64-__builtin_clzll((unsigned long long)ns));
+  if (bucket >= ZIPSTATS_BUCKETS) bucket = ZIPSTATS_BUCKETS-1;
+  __atomic_add_fetch(&(h->count),1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(h->total),ns,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(h->buckets[bucket]),1,__ATOMIC_RELAXED);
+}
+
+/* Records the time since *start* (from zipstats_start) */
+static void zipstats_timed(struct KNO_ZIPFILE *zf,int timer,long long start)
+{
+  if (start) {
+    long long ns = zip_nanotime()-start;
+    zipstats_record(&(zf->stats.timers[timer]),ns);
+    zipstats_record(&(zipstats_all.timers[timer]),ns);}
+}
+
+/* Locks the zipfile, recording how long that took */
+static void zipfile_lock(struct KNO_ZIPFILE *zf)
+{
+  long long start = zipstats_start();
+  u8_lock_mutex(&(zf->zipfile_lock));
+  zipstats_timed(zf,ZIPSTAT_LOCKWAIT,start);
+}
+
 /* Error messages */
 
 static lispval znumerr(u8_context cxt,int zerrno,u8_string path)
@@ -52,10 +294,11 @@ static lispval znumerr(u8_context cxt,int zerrno,u8_string path)
 		 KNO_VOID);
 }
 
-static lispval ziperr(u8_context cxt,kno_zipfile zf,lispval irritant)
+static lispval ziperr(u8_context cxt,kno_zipfile zf,struct zip *zip,
+		      lispval irritant)
 {
   u8_string details=
-    u8_mkstring("(%s) %s",zf->filename,zip_strerror(zf->zip));
+    u8_mkstring("(%s) %s",zf->filename,zip_strerror(zip));
   kno_seterr(ZipFileError,cxt,details,kno_incref(irritant));
   return KNO_ERROR_VALUE;
 }
@@ -69,13 +312,656 @@ static lispval zfilerr(u8_context cxt,kno_zipfile zf,struct zip_file *zfile,
   return kno_err(ZipFileError,cxt,details,irritant);
 }
 
+/* Reading the central directory */
+
+/* libzip doesn't tell us where entries live in the file, so we read
+   the central directory ourselves to get the local header offsets.
+   Entries in the central directory are in libzip index order. */
+
+#define ZIP_EOCD_SIG 0x06054b50
+#define ZIP64_EOCD_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_CDIR_SIG 0x02014b50
+#define ZIP_LOCAL_SIG 0x04034b50
+
+static unsigned int zip_get16(const unsigned char *p)
+{
+  return p[0]|(p[1]<<8);
+}
+static unsigned int zip_get32(const unsigned char *p)
+{
+  return ((unsigned int)p[0])|(((unsigned int)p[1])<<8)|
+    (((unsigned int)p[2])<<16)|(((unsigned int)p[3])<<24);
+}
+static unsigned long long zip_get64(const unsigned char *p)
+{
+  return ((unsigned long long)zip_get32(p))|
+    (((unsigned long long)zip_get32(p+4))<<32);
+}
+
+static ssize_t zip_pread(int fd,unsigned char *buf,size_t n,off_t off)
+{
+  size_t got = 0;
+  while (got<n) {
+    ssize_t delta = pread(fd,buf+got,n-got,off+got);
+    if (delta<0) {
+      if (errno == EINTR) continue;
+      else return -1;}
+    else if (delta == 0) break;
+    else got += delta;}
+  return got;
+}
+
+/* Finds the central directory in the file open as *fd* (of size
+   *fsize*), storing its offset, size and number of entries.  Returns
+   the offset of the end of central directory record or -1. */
+static off_t zip_find_cdir(int fd,off_t fsize,
+			   unsigned long long *cd_off,
+			   unsigned long long *cd_size,
+			   unsigned long long *cd_count)
+{
+  unsigned char tail[65536+22], *scan;
+  size_t tail_len = (fsize < (off_t)sizeof(tail)) ? (fsize) : (sizeof(tail));
+  off_t tail_off = fsize-tail_len;
+  if (tail_len<22) return -1;
+  if (zip_pread(fd,tail,tail_len,tail_off) != (ssize_t)tail_len) return -1;
+  scan = tail+tail_len-22;
+  while (scan>=tail) {
+    if (zip_get32(scan) == ZIP_EOCD_SIG) break;
+    else scan--;}
+  if (scan<tail) return -1;
+  *cd_count = zip_get16(scan+10);
+  *cd_size  = zip_get32(scan+12);
+  *cd_off   = zip_get32(scan+16);
+  if ( ( (*cd_count == 0xFFFF) || (*cd_size == 0xFFFFFFFF) ||
+	 (*cd_off == 0xFFFFFFFF) ) &&
+       ( (scan-tail) >= 20 ) &&
+       ( zip_get32(scan-20) == ZIP64_LOCATOR_SIG ) ) {
+    unsigned char z64[56];
+    unsigned long long z64_off = zip_get64(scan-20+8);
+    if ( (zip_pread(fd,z64,56,z64_off) == 56) &&
+	 (zip_get32(z64) == ZIP64_EOCD_SIG) ) {
+      *cd_count = zip_get64(z64+32);
+      *cd_size  = zip_get64(z64+40);
+      *cd_off   = zip_get64(z64+48);}}
+  return tail_off+(scan-tail);
+}
+
+/* Calls *fn* for each entry in the central directory in *cd*, passing
+   the entry's position, its record, and its local header offset.
+   Stops (returning -1) if the directory is malformed. */
+static long long zip_walk_cdir
+(const unsigned char *cd,size_t cd_size,
+ int (*fn)(long long i,const unsigned char *rec,
+	   unsigned long long local_off,void *data),
+ void *data)
+{
+  const unsigned char *scan = cd, *limit = cd+cd_size;
+  long long i = 0;
+  while ((scan+46) <= limit) {
+    unsigned int namelen, extralen, commentlen;
+    unsigned long long local_off;
+    if (zip_get32(scan) != ZIP_CDIR_SIG) return -1;
+    namelen = zip_get16(scan+28);
+    extralen = zip_get16(scan+30);
+    commentlen = zip_get16(scan+32);
+    if ((scan+46+namelen+extralen+commentlen) > limit) return -1;
+    local_off = zip_get32(scan+42);
+    if (local_off == 0xFFFFFFFF) {
+      /* The offset is in the ZIP64 extra field, after whichever
+	 of the sizes also overflowed */
+      const unsigned char *extra = scan+46+namelen;
+      const unsigned char *elim = extra+extralen;
+      while ((extra+4) <= elim) {
+	unsigned int id = zip_get16(extra), len = zip_get16(extra+2);
+	if (id == 0x0001) {
+	  const unsigned char *field = extra+4;
+	  if (zip_get32(scan+24) == 0xFFFFFFFF) field += 8;
+	  if (zip_get32(scan+20) == 0xFFFFFFFF) field += 8;
+	  if ((field+8) <= (extra+4+len)) local_off = zip_get64(field);
+	  break;}
+	extra += 4+len;}}
+    if (fn(i,scan,local_off,data)<0) return -1;
+    scan += 46+namelen+extralen+commentlen;
+    i++;}
+  return i;
+}
+
+/* Reads the central directory of the archive in *filename*, returning
+   a malloc'd buffer and storing its size. */
+static unsigned char *zip_read_cdir(u8_string filename,size_t *sizep)
+{
+  unsigned long long cd_off, cd_size, cd_count;
+  unsigned char *buf = NULL;
+  struct stat fileinfo;
+  int fd = open(filename,O_RDONLY);
+  if (fd<0) return NULL;
+  if ( (fstat(fd,&fileinfo) == 0) &&
+       (zip_find_cdir(fd,fileinfo.st_size,&cd_off,&cd_size,&cd_count)>=0) &&
+       ( (cd_off+cd_size) <= ((unsigned long long)fileinfo.st_size) ) ) {
+    buf = u8_malloc(cd_size+1);
+    if (zip_pread(fd,buf,cd_size,cd_off) != (ssize_t)cd_size) {
+      u8_free(buf); buf = NULL;}
+    else *sizep = cd_size;}
+  close(fd);
+  U8_CLEAR_ERRNO();
+  return buf;
+}
+
+/* The entry directory */
+
+static unsigned int zipdir_hash(u8_string name)
+{
+  const unsigned char *scan = name;
+  unsigned int hash = 2166136261U;
+  while (*scan) {
+    hash ^= *scan++;
+    hash *= 16777619U;}
+  return hash;
+}
+
+static struct KNO_ZIPENTRY *zipdir_lookup(struct KNO_ZIPDIR *dir,
+					  u8_string name)
+{
+  struct KNO_ZIPENTRY *scan =
+    dir->buckets[zipdir_hash(name)%(dir->n_buckets)];
+  while (scan) {
+    if (strcmp(scan->name,name) == 0) return scan;
+    else scan = scan->next;}
+  return NULL;
+}
+
+static int zipdir_set_offset(long long i,const unsigned char *rec,
+			     unsigned long long local_off,void *data)
+{
+  struct KNO_ZIPDIR *dir = (struct KNO_ZIPDIR *)data;
+  if (i<dir->n_entries) {
+    struct KNO_ZIPENTRY *entry = &(dir->entries[i]);
+    size_t namelen = zip_get16(rec+28);
+    /* Only trust the offset if the names line up */
+    if ( (entry->name) && (strlen(entry->name) == namelen) &&
+	 (memcmp(entry->name,rec+46,namelen) == 0) )
+      entry->offset = local_off;}
+  return 0;
+}
+
+static void free_zipdir(struct KNO_ZIPDIR *dir)
+{
+  long long i = 0, n = dir->n_entries;
+  while (i<n) {
+    if (dir->entries[i].name) u8_free(dir->entries[i].name);
+    i++;}
+  u8_free(dir->entries);
+  u8_free(dir->buckets);
+  u8_free(dir->sorted);
+  u8_free(dir);
+}
+
+static int zipentry_name_cmp(const void *vx,const void *vy)
+{
+  const struct KNO_ZIPENTRY *x = *((const struct KNO_ZIPENTRY **)vx);
+  const struct KNO_ZIPENTRY *y = *((const struct KNO_ZIPENTRY **)vy);
+  return strcmp(x->name,y->name);
+}
+
+/* Returns the position in the sorted entries of the first name which
+   doesn't sort before *prefix* or, if *after* is true, the first
+   which doesn't start with *prefix* and sorts after it. */
+static long long zipdir_bound(struct KNO_ZIPDIR *dir,u8_string prefix,
+			      size_t prefix_len,int after)
+{
+  long long lo = 0, hi = dir->n_sorted;
+  while (lo<hi) {
+    long long mid = lo+(hi-lo)/2;
+    int cmp = strncmp(dir->sorted[mid]->name,prefix,prefix_len);
+    if ( (cmp<0) || ( (after) && (cmp == 0) ) )
+      lo = mid+1;
+    else hi = mid;}
+  return lo;
+}
+
+static struct KNO_ZIPDIR *make_zipdir(struct KNO_ZIPFILE *zf,struct zip *zip)
+{
+  long long i = 0, n = zip_get_num_entries(zip,0);
+  unsigned int n_buckets = (n<8) ? (17) : ((n*2)+1);
+  struct KNO_ZIPDIR *dir = u8_alloc(struct KNO_ZIPDIR);
+  unsigned char *cdir; size_t cd_size = 0;
+  if (n<0) n = 0;
+  dir->n_entries = n;
+  dir->entries = u8_alloc_n((n) ? (n) : (1),struct KNO_ZIPENTRY);
+  dir->n_buckets = n_buckets;
+  dir->buckets = u8_alloc_n(n_buckets,struct KNO_ZIPENTRY *);
+  memset(dir->buckets,0,sizeof(struct KNO_ZIPENTRY *)*n_buckets);
+  while (i<n) {
+    struct KNO_ZIPENTRY *entry = &(dir->entries[i]);
+    struct zip_stat zstat;
+    memset(entry,0,sizeof(struct KNO_ZIPENTRY));
+    entry->index = i; entry->offset = -1;
+    if ( (zip_stat_index(zip,i,0,&zstat) == 0) &&
+	 (zstat.valid&ZIP_STAT_NAME) ) {
+      unsigned int bucket;
+      entry->name = u8_strdup(zstat.name);
+      entry->size = zstat.size;
+      entry->csize = zstat.comp_size;
+      entry->mtime = zstat.mtime;
+      entry->crc = zstat.crc;
+      entry->method = zstat.comp_method;
+      entry->encryption = zstat.encryption_method;
+      bucket = zipdir_hash(entry->name)%n_buckets;
+      entry->next = dir->buckets[bucket];
+      dir->buckets[bucket] = entry;}
+    i++;}
+  if ( (n) && (!(zf->inmem)) &&
+       ((cdir = zip_read_cdir(zf->filename,&cd_size))) ) {
+    zip_walk_cdir(cdir,cd_size,zipdir_set_offset,dir);
+    u8_free(cdir);}
+  dir->sorted = u8_alloc_n((n) ? (n) : (1),struct KNO_ZIPENTRY *);
+  dir->n_sorted = 0;
+  i = 0; while (i<n) {
+    if (dir->entries[i].name)
+      dir->sorted[dir->n_sorted++] = &(dir->entries[i]);
+    i++;}
+  qsort(dir->sorted,dir->n_sorted,sizeof(struct KNO_ZIPENTRY *),
+	zipentry_name_cmp);
+  return dir;
+}
+
+/* Drops the entry directory of a writable zipfile after it's been
+   modified. Called with the zipfile locked. */
+static void zipdir_invalidate(struct KNO_ZIPFILE *zf)
+{
+  if (zf->zipdir) {
+    struct KNO_ZIPDIR *dir = zf->zipdir;
+    zf->zipdir = NULL;
+    free_zipdir(dir);}
+}
+
+/* Looks up *name* in the zipfile, using the entry directory when it
+   is valid and libzip otherwise. Returns 1 if found, 0 if not, and -1
+   on error. */
+static int zipfile_lookup(struct KNO_ZIPFILE *zf,struct zip *zip,
+			  u8_string name,struct KNO_ZIPENTRY *into)
+{
+  long long start = zipstats_start();
+  if (zf->zipdir) {
+    struct KNO_ZIPENTRY *entry = zipdir_lookup(zf->zipdir,name);
+    zipstats_timed(zf,ZIPSTAT_LOOKUP,start);
+    if (entry == NULL) return 0;
+    if (into) *into = *entry;
+    return 1;}
+  else {
+    struct zip_stat zstat;
+    long long index = zip_name_locate(zip,name,0);
+    zipstats_timed(zf,ZIPSTAT_LOOKUP,start);
+    if (index<0) return 0;
+    else if (into == NULL) return 1;
+    else if (zip_stat_index(zip,index,0,&zstat)) return -1;
+    memset(into,0,sizeof(struct KNO_ZIPENTRY));
+    into->name = name; into->index = index;
+    into->size = zstat.size; into->csize = zstat.comp_size;
+    into->mtime = zstat.mtime; into->crc = zstat.crc;
+    into->method = zstat.comp_method;
+    into->encryption = zstat.encryption_method;
+    into->offset = -1;
+    return 1;}
+}
+
+/* Entry caches */
+
+static struct KNO_ZIPCACHE *make_zipcache(size_t budget)
+{
+  struct KNO_ZIPCACHE *cache = u8_alloc(struct KNO_ZIPCACHE);
+  memset(cache,0,sizeof(struct KNO_ZIPCACHE));
+  u8_init_mutex(&(cache->cache_lock));
+  u8_init_condvar(&(cache->inflight_done));
+  cache->budget = budget;
+  cache->n_buckets = 1021;
+  cache->buckets = u8_alloc_n(cache->n_buckets,struct KNO_ZIPCACHED *);
+  memset(cache->buckets,0,sizeof(struct KNO_ZIPCACHED *)*cache->n_buckets);
+  return cache;
+}
+
+/* Called with the cache locked */
+static void zipcache_remove(struct KNO_ZIPCACHE *cache,
+			    struct KNO_ZIPCACHED *item)
+{
+  struct KNO_ZIPCACHED **scan = &(cache->buckets[item->hash%cache->n_buckets]);
+  while (*scan) {
+    if (*scan == item) {
+      *scan = item->hnext; break;}
+    else scan = &((*scan)->hnext);}
+  if (item->newer) item->newer->older = item->older;
+  else cache->newest = item->older;
+  if (item->older) item->older->newer = item->newer;
+  else cache->oldest = item->newer;
+  cache->used -= item->size;
+  cache->n_entries--;
+  kno_decref(item->value);
+  u8_free(item->name);
+  u8_free(item);
+}
+
+static void free_zipcache(struct KNO_ZIPCACHE *cache)
+{
+  while (cache->oldest) zipcache_remove(cache,cache->oldest);
+  u8_destroy_condvar(&(cache->inflight_done));
+  u8_destroy_mutex(&(cache->cache_lock));
+  u8_free(cache->buckets);
+  u8_free(cache);
+}
+
+/* Called with the cache locked */
+static struct KNO_ZIPCACHED *zipcache_find(struct KNO_ZIPCACHE *cache,
+					   u8_string name,unsigned int hash)
+{
+  struct KNO_ZIPCACHED *scan = cache->buckets[hash%cache->n_buckets];
+  while (scan) {
+    if ( (scan->hash == hash) && (strcmp(scan->name,name) == 0) )
+      return scan;
+    else scan = scan->hnext;}
+  return NULL;
+}
+
+static size_t zipcache_valsize(lispval value)
+{
+  if (KNO_STRINGP(value)) return KNO_STRLEN(value);
+  else if (KNO_PACKETP(value)) return KNO_PACKET_LENGTH(value);
+  else return 0;
+}
+
+/* Called with the cache locked */
+static struct KNO_ZIPFETCH **zipcache_inflight(struct KNO_ZIPCACHE *cache,
+					       u8_string name,
+					       unsigned int hash)
+{
+  struct KNO_ZIPFETCH **scan = &(cache->inflight);
+  while (*scan) {
+    if ( ((*scan)->hash == hash) && (strcmp((*scan)->name,name) == 0) )
+      return scan;
+    else scan = &((*scan)->next);}
+  return NULL;
+}
+
+static int istext(u8_byte *buf,size_t size);
+
+/* Returns the cached content of *name*, converted if needed to the
+   kind of value *isbinary* asks for, or KNO_VOID. If *wait* is true
+   and *name* is being prefetched, this waits for it. Callers holding
+   the lock of a writable zipfile mustn't wait, since the prefetch
+   needs it. */
+static lispval zipcache_get(struct KNO_ZIPCACHE *cache,u8_string name,
+			    lispval isbinary,int wait)
+{
+  unsigned int hash = zipdir_hash(name);
+  struct KNO_ZIPCACHED *item;
+  lispval value = KNO_VOID;
+  u8_lock_mutex(&(cache->cache_lock));
+  item = zipcache_find(cache,name,hash);
+  if ( (item == NULL) && (wait) && (zipcache_inflight(cache,name,hash)) ) {
+    cache->waits++;
+    while (zipcache_inflight(cache,name,hash))
+      u8_condvar_wait(&(cache->inflight_done),&(cache->cache_lock));
+    item = zipcache_find(cache,name,hash);}
+  if (item == NULL) {
+    cache->misses++;
+    u8_unlock_mutex(&(cache->cache_lock));
+    return KNO_VOID;}
+  cache->hits++;
+  if (cache->newest != item) {
+    /* Move it to the front of the LRU list */
+    if (item->older) item->older->newer = item->newer;
+    else cache->oldest = item->newer;
+    item->newer->older = item->older;
+    item->older = cache->newest;
+    item->newer = NULL;
+    cache->newest->newer = item;
+    cache->newest = item;}
+  value = kno_incref(item->value);
+  u8_unlock_mutex(&(cache->cache_lock));
+  /* The content may have been cached by a reader which asked for the
+     other kind of value, so auto-detection is done again */
+  if (KNO_VOIDP(isbinary)) {
+    if (KNO_STRINGP(value))
+      isbinary = (istext((u8_byte *)KNO_CSTRING(value),KNO_STRLEN(value))) ?
+	(KNO_FALSE) : (KNO_TRUE);
+    else if (KNO_PACKETP(value))
+      isbinary = (istext((u8_byte *)KNO_PACKET_DATA(value),
+			 KNO_PACKET_LENGTH(value))) ?
+	(KNO_FALSE) : (KNO_TRUE);}
+  if ( (KNO_STRINGP(value)) && (KNO_TRUEP(isbinary)) ) {
+    lispval packet = kno_make_packet(NULL,KNO_STRLEN(value),
+				     KNO_CSTRING(value));
+    kno_decref(value);
+    return packet;}
+  else if ( (KNO_PACKETP(value)) && (KNO_FALSEP(isbinary)) ) {
+    lispval string = kno_make_string(NULL,KNO_PACKET_LENGTH(value),
+				     KNO_PACKET_DATA(value));
+    kno_decref(value);
+    return string;}
+  else return value;
+}
+
+static void zipcache_put(struct KNO_ZIPCACHE *cache,u8_string name,
+			 lispval value)
+{
+  unsigned int hash = zipdir_hash(name);
+  size_t size = zipcache_valsize(value)+strlen(name)+
+    sizeof(struct KNO_ZIPCACHED);
+  struct KNO_ZIPCACHED *item;
+  if (size > cache->budget) return;
+  u8_lock_mutex(&(cache->cache_lock));
+  if ((item = zipcache_find(cache,name,hash)))
+    zipcache_remove(cache,item);
+  while ( (cache->oldest) && ((cache->used+size) > cache->budget) ) {
+    zipcache_remove(cache,cache->oldest);
+    cache->evictions++;}
+  item = u8_alloc(struct KNO_ZIPCACHED);
+  item->name = u8_strdup(name);
+  item->hash = hash;
+  item->value = kno_incref(value);
+  item->size = size;
+  item->hnext = cache->buckets[hash%cache->n_buckets];
+  cache->buckets[hash%cache->n_buckets] = item;
+  item->newer = NULL;
+  item->older = cache->newest;
+  if (cache->newest) cache->newest->newer = item;
+  else cache->oldest = item;
+  cache->newest = item;
+  cache->used += size;
+  cache->n_entries++;
+  u8_unlock_mutex(&(cache->cache_lock));
+}
+
+/* Marks *name* as being prefetched, returning 0 if it's already
+   cached or in flight (or the cache is off) */
+static int zipcache_claim(struct KNO_ZIPCACHE *cache,u8_string name)
+{
+  unsigned int hash = zipdir_hash(name);
+  int claimed = 0;
+  u8_lock_mutex(&(cache->cache_lock));
+  if ( (cache->budget>0) && (zipcache_find(cache,name,hash) == NULL) &&
+       (zipcache_inflight(cache,name,hash) == NULL) ) {
+    struct KNO_ZIPFETCH *fetch = u8_alloc(struct KNO_ZIPFETCH);
+    fetch->name = u8_strdup(name);
+    fetch->hash = hash;
+    fetch->next = cache->inflight;
+    cache->inflight = fetch;
+    cache->prefetches++;
+    claimed = 1;}
+  u8_unlock_mutex(&(cache->cache_lock));
+  return claimed;
+}
+
+/* Ends the prefetch of *name*, waking any readers waiting for it */
+static void zipcache_settle(struct KNO_ZIPCACHE *cache,u8_string name)
+{
+  struct KNO_ZIPFETCH **ptr, *fetch = NULL;
+  u8_lock_mutex(&(cache->cache_lock));
+  ptr = zipcache_inflight(cache,name,zipdir_hash(name));
+  if (ptr) {
+    fetch = *ptr;
+    *ptr = fetch->next;}
+  u8_condvar_broadcast(&(cache->inflight_done));
+  u8_unlock_mutex(&(cache->cache_lock));
+  if (fetch) {
+    u8_free(fetch->name);
+    u8_free(fetch);}
+}
+
+static void zipcache_drop(struct KNO_ZIPCACHE *cache,u8_string name)
+{
+  struct KNO_ZIPCACHED *item;
+  u8_lock_mutex(&(cache->cache_lock));
+  if ((item = zipcache_find(cache,name,zipdir_hash(name))))
+    zipcache_remove(cache,item);
+  u8_unlock_mutex(&(cache->cache_lock));
+}
+
 /* Zip file utilities */
 
+static void drop_zipreaders(struct KNO_ZIPFILE *zf)
+{
+  struct KNO_ZIPREADER *scan, *next;
+  u8_lock_mutex(&(zf->readers_lock));
+  scan = zf->readers; zf->readers = NULL; zf->n_readers = 0;
+  u8_unlock_mutex(&(zf->readers_lock));
+  while (scan) {
+    next = scan->next;
+    zip_discard(scan->zip);
+    u8_free(scan);
+    scan = next;}
+}
+
+/* Called with the zipfile locked, after it's been committed or
+   discarded */
+static void drop_zipdonors(struct KNO_ZIPFILE *zf)
+{
+  struct KNO_ZIPDONOR *scan = zf->donors, *next;
+  zf->donors = NULL;
+  while (scan) {
+    next = scan->next;
+    zip_discard(scan->zip);
+    kno_decref(scan->packet);
+    u8_free(scan->filename);
+    u8_free(scan);
+    scan = next;}
+}
+
+/* In-memory archives */
+
+/* Zipfiles can also be read from a packet (zip/open-packet) or
+   created in memory (zip/make-packet), using libzip buffer sources.
+   Handles on a packet read its bytes in place, so opening one doesn't
+   copy the archive; the zipfile holds a reference to the packet.
+   Committing an archive created in memory returns it as a packet and
+   finishes it, so that it can still be read but not modified. */
+
+static long long zipfile_packet_count = 0;
+
+static u8_string zip_packet_label()
+{
+  long long n = __atomic_add_fetch(&zipfile_packet_count,1,__ATOMIC_RELAXED);
+  return u8_mkstring("packet:%lld",n);
+}
+
+/* Opens a handle on the archive in *packet* or, if it's not a packet,
+   on a new empty archive. If *keep* is provided, the buffer source is
+   kept (and stored there) so its content can be read after the handle
+   is closed. */
+static struct zip *zip_open_packet(lispval packet,int flags,
+				   struct zip_source **keep,int *errflag)
+{
+  struct zip_source *src;
+  struct zip *zip = NULL;
+  zip_error_t error;
+  zip_error_init(&error);
+  if (KNO_PACKETP(packet))
+    src = zip_source_buffer_create(KNO_PACKET_DATA(packet),
+				   KNO_PACKET_LENGTH(packet),0,&error);
+  else src = zip_source_buffer_create(NULL,0,0,&error);
+  if (src) {
+    zip = zip_open_from_source(src,flags&(~ZIP_EXCL),&error);
+    if (zip == NULL)
+      zip_source_free(src);
+    else if (keep) {
+      zip_source_keep(src);
+      *keep = src;}}
+  if (zip == NULL) *errflag = zip_error_code_zip(&error);
+  zip_error_fini(&error);
+  return zip;
+}
+
+/* Opens a new handle on the archive of *zf*, wherever it lives. An
+   in-memory archive's packet is only set once, when it's committed,
+   and is kept until the zipfile is freed. */
+static struct zip *zipfile_open_handle(struct KNO_ZIPFILE *zf,int flags,
+				       int *errflag)
+{
+  if (zf->inmem)
+    return zip_open_packet(zf->packet,flags,NULL,errflag);
+  else return zip_open(zf->filename,flags,errflag);
+}
+
+/* Returns the content of the kept buffer source of an in-memory
+   archive which has just been committed. libzip removes archives
+   with no entries rather than writing them, so those get an end of
+   central directory record and nothing else. */
+static lispval zipfile_memsrc_packet(struct KNO_ZIPFILE *zf,int empty)
+{
+  struct zip_source *src = zf->memsrc;
+  struct zip_stat st;
+  unsigned char *buf;
+  zip_uint64_t size, read = 0;
+  if (empty) {
+    static const unsigned char empty_archive[22] = {'P','K',5,6};
+    buf = u8_malloc(22);
+    memcpy(buf,empty_archive,22);
+    return kno_init_packet(NULL,22,buf);}
+  zip_stat_init(&st);
+  if ( (zip_source_stat(src,&st)<0) || (!(st.valid&ZIP_STAT_SIZE)) ||
+       (st.size > INT_MAX) || (zip_source_open(src)<0) )
+    return kno_err(ZipFileError,"zipfile_memsrc_packet",
+		   u8_mkstring("(%s) %s",zf->filename,
+			       zip_error_strerror(zip_source_error(src))),
+		   KNO_VOID);
+  size = st.size;
+  buf = u8_malloc(size+1);
+  while (read<size) {
+    zip_int64_t got = zip_source_read(src,buf+read,size-read);
+    if (got<=0) break;
+    else read += got;}
+  zip_source_close(src);
+  if (read<size) {
+    u8_free(buf);
+    return kno_err(ZipFileError,"zipfile_memsrc_packet",
+		   u8_mkstring("(%s) %s",zf->filename,
+			       zip_error_strerror(zip_source_error(src))),
+		   KNO_VOID);}
+  return kno_init_packet(NULL,size,buf);
+}
+
 static void recycle_zipfile(struct KNO_RAW_CONS *c)
 {
   struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *)c;
-  if (!(zf->closed)) zip_close(zf->zip);
+  if (zf->closed) {}
+  else if (zf->inmem)
+    /* Nothing can get an uncommitted in-memory archive now */
+    zip_discard(zf->zip);
+  else zip_close(zf->zip);
   zf->closed = 1;
+  if (zf->memsrc) zip_source_free(zf->memsrc);
+  zf->memsrc = NULL;
+  kno_decref(zf->packet);
+  zf->packet = KNO_VOID;
+  drop_zipdonors(zf);
+  drop_zipreaders(zf);
+  if (zf->zipdir) free_zipdir(zf->zipdir);
+  zf->zipdir = NULL;
+  if (zf->cache) free_zipcache(zf->cache);
+  zf->cache = NULL;
+  kno_decref(zf->autochoices);
+  zf->autochoices = KNO_EMPTY;
+  u8_destroy_mutex(&(zf->readers_lock));
   u8_destroy_mutex(&(zf->zipfile_lock));
   u8_free(zf->filename);
   if (!(KNO_STATIC_CONSP(c))) u8_free(c);
@@ -84,32 +970,131 @@ static void recycle_zipfile(struct KNO_RAW_CONS *c)
 static int unparse_zipfile(struct U8_OUTPUT *out,lispval x)
 {
   struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *)x;
-  u8_printf(out,"#<ZIPFILE '%s'%s>",
-	    zf->filename,((zf->closed)?(" closed"):""));
+  u8_printf(out,"#<ZIPFILE '%s'%s%s>",
+	    zf->filename,((zf->readonly)?(" readonly"):""),
+	    ((zf->closed)?(" closed"):""));
   return 1;
 }
 
+/* zf->closed only changes with the zipfile locked, but read-only
+   zipfiles check it without the lock */
+static int zipfile_closedp(struct KNO_ZIPFILE *zf)
+{
+  return __atomic_load_n(&(zf->closed),__ATOMIC_ACQUIRE);
+}
+
 static lispval zipreopen(struct KNO_ZIPFILE *zf,int locked)
 {
-  if (!(zf->closed)) return KNO_FALSE;
+  if (!(zipfile_closedp(zf))) return KNO_FALSE;
   else {
     int errflag;
     struct zip *zip;
-    if (!(locked)) u8_lock_mutex(&(zf->zipfile_lock));
+    if (!(locked)) zipfile_lock(zf);
     if (!(zf->closed)) {
       if (!(locked)) u8_unlock_mutex(&(zf->zipfile_lock));
       return KNO_FALSE;}
-    else zip = zip_open(zf->filename,zf->flags,&errflag);
+    else zip = zipfile_open_handle
+	   (zf,(zf->inmem) ? (zf->flags|ZIP_RDONLY) : (zf->flags),&errflag);
     if (!(zip)) {
       lispval errval = znumerr("zipreopen",errflag,zf->filename);
       if (!(locked)) u8_unlock_mutex(&(zf->zipfile_lock));
       return errval;}
     else {
-      zf->zip = zip; zf->closed = 0;
+      zf->zip = zip;
+      __atomic_store_n(&(zf->closed),0,__ATOMIC_RELEASE);
+      ZIPSTATS_COUNT(zf,reopens,1);
+      if ( (zf->zipdir == NULL) && (!(zf->lazy)) )
+	zf->zipdir = make_zipdir(zf,zip);
       if (!(locked)) u8_unlock_mutex(&(zf->zipfile_lock));
       return KNO_TRUE;}}
 }
 
+/* Getting handles for reading */
+
+/* For read-only zipfiles, readers get a handle from the reader pool
+   (opening a new one if the pool is empty) and don't hold
+   zipfile_lock at all.  Otherwise, this locks the zipfile (reopening
+   it if needed) and returns the primary handle. Pooled handles don't
+   share anything with the primary one, so a reader can keep using its
+   handle if the zipfile is closed meanwhile; release_zip then discards
+   it rather than pooling it. */
+static struct zip *use_zip(struct KNO_ZIPFILE *zf,u8_context cxt)
+{
+  if (zf->readonly) {
+    struct KNO_ZIPREADER *reader = NULL;
+    struct zip *zip = NULL;
+    int errflag = 0;
+    if (zipfile_closedp(zf)) {
+      lispval errval = zipreopen(zf,0);
+      if (KNO_ABORTP(errval)) return NULL;}
+    u8_lock_mutex(&(zf->readers_lock));
+    if (zf->readers) {
+      reader = zf->readers;
+      zf->readers = reader->next;
+      zf->n_readers--;}
+    u8_unlock_mutex(&(zf->readers_lock));
+    if (reader) {
+      zip = reader->zip;
+      u8_free(reader);
+      return zip;}
+    zip = zipfile_open_handle(zf,(zf->flags&(~ZIP_CHECKCONS))|ZIP_RDONLY,
+			      &errflag);
+    if (zip == NULL) znumerr(cxt,errflag,zf->filename);
+    U8_CLEAR_ERRNO();
+    return zip;}
+  else {
+    zipfile_lock(zf);
+    if (zf->closed) {
+      lispval errval = zipreopen(zf,1);
+      if (KNO_ABORTP(errval)) {
+	u8_unlock_mutex(&(zf->zipfile_lock));
+	return NULL;}}
+    return zf->zip;}
+}
+
+static void release_zip(struct KNO_ZIPFILE *zf,struct zip *zip);
+
+/* Builds the entry directory of a read-only zipfile opened with the
+   `lazy` option the first time it's needed. Other threads may be
+   reading zf->zipdir without the lock, so it's only set once the
+   directory is complete. If there's an error getting a handle, the
+   directory is left unbuilt and callers fall back to libzip, which
+   will report it. */
+static void zipfile_ensure_dir(struct KNO_ZIPFILE *zf)
+{
+  if ( (zf->lazy) && (zf->readonly) &&
+       (__atomic_load_n(&(zf->zipdir),__ATOMIC_ACQUIRE) == NULL) ) {
+    struct zip *zip = use_zip(zf,"zipfile_ensure_dir");
+    struct KNO_ZIPDIR *dir;
+    if (zip == NULL) {
+      kno_clear_errors(0);
+      return;}
+    dir = make_zipdir(zf,zip);
+    release_zip(zf,zip);
+    zipfile_lock(zf);
+    if (zf->zipdir == NULL)
+      __atomic_store_n(&(zf->zipdir),dir,__ATOMIC_RELEASE);
+    else free_zipdir(dir);
+    u8_unlock_mutex(&(zf->zipfile_lock));}
+}
+
+static void release_zip(struct KNO_ZIPFILE *zf,struct zip *zip)
+{
+  if (zf->readonly) {
+    u8_lock_mutex(&(zf->readers_lock));
+    if ( (zipfile_closedp(zf)) || (zf->n_readers >= zf->max_readers) ) {
+      u8_unlock_mutex(&(zf->readers_lock));
+      zip_discard(zip);}
+    else {
+      struct KNO_ZIPREADER *reader = u8_alloc(struct KNO_ZIPREADER);
+      reader->zip = zip;
+      reader->next = zf->readers;
+      zf->readers = reader;
+      zf->n_readers++;
+      u8_unlock_mutex(&(zf->readers_lock));}}
+  else u8_unlock_mutex(&(zf->zipfile_lock));
+}
+
 
 DEFC_PRIM("zipfile?",iszipfile_prim,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
@@ -123,7 +1108,45 @@ static lispval iszipfile_prim(lispval arg)
 
 /* Creating/opening zip files */
 
-static lispval zipopen(u8_string path,int zflags,int oflags)
+/* Makes a zipfile object for the open handle *zip*, taking ownership
+   of *filename*. In-memory archives have either the *packet* they
+   were read from or the kept buffer source *memsrc* they're being
+   written to. */
+static lispval zipfile_init(struct zip *zip,u8_string filename,int zflags,
+			    int readonly,int lazy,lispval packet,
+			    struct zip_source *memsrc)
+{
+  struct KNO_ZIPFILE *zf = u8_alloc(struct KNO_ZIPFILE);
+  KNO_INIT_FRESH_CONS(zf,kno_zipfile_type);
+  u8_init_mutex(&(zf->zipfile_lock));
+  u8_init_mutex(&(zf->readers_lock));
+  zf->filename = filename; zf->flags = zflags; zf->closed = 0;
+  zf->readonly = readonly;
+  zf->zip = zip;
+  zf->inmem = ( (KNO_PACKETP(packet)) || (memsrc != NULL) );
+  zf->packet = kno_incref(packet);
+  zf->memsrc = memsrc;
+  zf->lazy = lazy;
+  zf->zipdir = (lazy) ? (NULL) : (make_zipdir(zf,zip));
+  zf->commit_threads = zipfile_commit_threads;
+  zf->deflate_level = Z_DEFAULT_COMPRESSION;
+  zf->pending = NULL;
+  zf->donors = NULL;
+  memset(&(zf->stats),0,sizeof(struct KNO_ZIPSTATS));
+  zf->append_commit = zf->append_blocked = 0;
+  zf->autostore = zipfile_autostore;
+  zf->dedup = zipfile_dedup;
+  zf->autochoices = KNO_EMPTY;
+  zf->cache = (zipfile_cache_budget>0) ?
+    (make_zipcache(zipfile_cache_budget)) : (NULL);
+  zf->readers = NULL; zf->n_readers = 0;
+  zf->max_readers = zipfile_max_readers;
+  zf->share_count = 0;
+  return LISP_CONS(zf);
+}
+
+static lispval zipopen(u8_string path,int zflags,int oflags,int readonly,
+		       int lazy)
 {
   int errflag = 0, flags = zflags|oflags;
   u8_string abspath = u8_abspath(path,NULL);
@@ -132,30 +1155,316 @@ static lispval zipopen(u8_string path,int zflags,int oflags)
     U8_CLEAR_ERRNO();
     return KNO_ERROR_VALUE;}
   else {
-    struct zip *zip = zip_open(abspath,flags,&errflag);
+    struct zip *zip;
+    if (readonly) {
+      zflags |= ZIP_RDONLY; flags |= ZIP_RDONLY;}
+    zip = zip_open(abspath,flags,&errflag);
     if (zip) {
-      struct KNO_ZIPFILE *zf = u8_alloc(struct KNO_ZIPFILE);
-      KNO_INIT_FRESH_CONS(zf,kno_zipfile_type);
-      u8_init_mutex(&(zf->zipfile_lock));
-      zf->filename = abspath; zf->flags = zflags; zf->closed = 0;
-      zf->zip = zip;
       U8_CLEAR_ERRNO();
-      return LISP_CONS(zf);}
+      return zipfile_init(zip,abspath,zflags,readonly,lazy,KNO_VOID,NULL);}
     else {
       U8_CLEAR_ERRNO();
       return znumerr("open_zipfile",errflag,abspath);}}
 }
 
+static int zipopt(lispval opts,lispval sym)
+{
+  lispval v = kno_getopt(opts,sym,KNO_FALSE);
+  int result = (!((KNO_FALSEP(v))||(KNO_VOIDP(v))));
+  kno_decref(v);
+  return result;
+}
+
+/* Handles the `cache` option and, depending on whether *zf* is
+   read-only, the `readers` or the `threads`, `autostore` and `dedup`
+   options */
+static void zipfile_setopts(struct KNO_ZIPFILE *zf,lispval opts)
+{
+  lispval cache = kno_getopt(opts,cache_symbol,KNO_VOID);
+  if ( (KNO_FIXNUMP(cache)) || (KNO_FALSEP(cache)) ) {
+    if (zf->cache) free_zipcache(zf->cache);
+    zf->cache = ( (KNO_FIXNUMP(cache)) && (KNO_FIX2INT(cache)>0) ) ?
+      (make_zipcache(KNO_FIX2INT(cache))) : (NULL);}
+  kno_decref(cache);
+  if (zf->readonly) {
+    lispval readers = kno_getopt(opts,readers_symbol,KNO_VOID);
+    if (KNO_FIXNUMP(readers))
+      zf->max_readers = KNO_FIX2INT(readers);
+    kno_decref(readers);}
+  else {
+    lispval threads = kno_getopt(opts,threads_symbol,KNO_VOID);
+    lispval autostore = kno_getopt(opts,autostore_symbol,KNO_VOID);
+    lispval dedup = kno_getopt(opts,dedup_symbol,KNO_VOID);
+    if (KNO_FIXNUMP(threads))
+      zf->commit_threads = KNO_FIX2INT(threads);
+    if (!(KNO_VOIDP(autostore)))
+      zf->autostore = (!(KNO_FALSEP(autostore)));
+    if (!(KNO_VOIDP(dedup)))
+      zf->dedup = (!(KNO_FALSEP(dedup)));
+    kno_decref(threads);
+    kno_decref(autostore);
+    kno_decref(dedup);}
+}
+
+/* Sharing read-only zipfiles */
+
+/* Read-only zipfiles opened with the `shared` option (or with the
+   ZIPSHARED config) are kept in a registry keyed by the file's device
+   and inode and by the options which affect how it's read (consistency
+   checks, lazy directories, caching and readers), so that
+   opening the same archive again the same way returns the zipfile
+   which is already open rather than parsing its directory again. An
+   entry is only reused while the file's size and modification time
+   are unchanged. The registry holds a reference to each zipfile until
+   it's replaced or dropped with zip/unshare!.
+
+   Each zip/open which returns a shared zipfile counts as a share of
+   it, and zip/close! only gives up the caller's share, really closing
+   the zipfile when the last share is closed. */
+
+/* Options which must match for an open zipfile to be shared. The cache
+   and readers are -1 when they weren't given. */
+typedef struct KNO_ZIPSHARE_OPTS {
+  int nocheck, lazy, readers;
+  long long cache;} KNO_ZIPSHARE_OPTS;
+
+typedef struct KNO_ZIPSHARED {
+  u8_string path;
+  struct KNO_ZIPSHARE_OPTS opts;
+  dev_t dev; ino_t ino; off_t size; time_t mtime;
+  lispval zipfile;
+  struct KNO_ZIPSHARED *next;} KNO_ZIPSHARED;
+typedef struct KNO_ZIPSHARED *kno_zipshared;
+
+static struct KNO_ZIPSHARED *zipshared = NULL;
+static u8_mutex zipshared_lock;
+
+static void zipshare_opts(lispval opts,int nocheck,int lazy,
+			  struct KNO_ZIPSHARE_OPTS *into)
+{
+  lispval cache = kno_getopt(opts,cache_symbol,KNO_VOID);
+  lispval readers = kno_getopt(opts,readers_symbol,KNO_VOID);
+  into->nocheck = nocheck;
+  into->lazy = lazy;
+  if (KNO_FIXNUMP(cache))
+    into->cache = (KNO_FIX2INT(cache)>0) ? (KNO_FIX2INT(cache)) : (0);
+  else if (KNO_FALSEP(cache))
+    into->cache = 0;
+  else into->cache = -1;
+  into->readers = (KNO_FIXNUMP(readers)) ? (KNO_FIX2INT(readers)) : (-1);
+  kno_decref(cache);
+  kno_decref(readers);
+}
+
+static int zipshare_opts_samep(struct KNO_ZIPSHARE_OPTS *x,
+			       struct KNO_ZIPSHARE_OPTS *y)
+{
+  return ( (x->nocheck == y->nocheck) && (x->lazy == y->lazy) && (x->readers == y->readers) &&
+	   (x->cache == y->cache) );
+}
+
+static int zipshared_samep(struct KNO_ZIPSHARED *entry,struct stat *info)
+{
+  return ( (entry->dev == info->st_dev) && (entry->ino == info->st_ino) &&
+	   (entry->size == info->st_size) &&
+	   (entry->mtime == info->st_mtime) );
+}
+
+/* Called with zipshared_lock locked */
+static void zipshared_drop(struct KNO_ZIPSHARED **ptr)
+{
+  struct KNO_ZIPSHARED *entry = *ptr;
+  *ptr = entry->next;
+  kno_decref(entry->zipfile);
+  u8_free(entry->path);
+  u8_free(entry);
+}
+
+/* Returns the shared zipfile for *abspath* opened with *opts*, or
+   KNO_VOID, dropping any registry entries for the path if the file
+   has changed. */
+static lispval zipshared_get(u8_string abspath,
+			     struct KNO_ZIPSHARE_OPTS *opts)
+{
+  struct KNO_ZIPSHARED **ptr;
+  struct stat info;
+  lispval result = KNO_VOID;
+  if (stat(abspath,&info)<0) {
+    U8_CLEAR_ERRNO();
+    return result;}
+  u8_lock_mutex(&zipshared_lock);
+  ptr = &zipshared;
+  while (*ptr) {
+    struct KNO_ZIPSHARED *entry = *ptr;
+    if ( (entry->dev == info.st_dev) && (entry->ino == info.st_ino) &&
+	 (zipshared_samep(entry,&info)) ) {
+      if ( (KNO_VOIDP(result)) &&
+	   (zipshare_opts_samep(&(entry->opts),opts)) ) {
+	struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *) entry->zipfile;
+	zf->share_count++;
+	result = kno_incref(entry->zipfile);}
+      ptr = &(entry->next);}
+    else if (strcmp(entry->path,abspath) == 0)
+      zipshared_drop(ptr);
+    else ptr = &(entry->next);}
+  u8_unlock_mutex(&zipshared_lock);
+  return result;
+}
+
+/* Registers *zipfile*, returning it or, if another thread has just
+   registered the same archive, that zipfile instead. */
+static lispval zipshared_put(lispval zipfile,struct KNO_ZIPSHARE_OPTS *opts)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  struct KNO_ZIPSHARED *entry;
+  struct stat info;
+  if (stat(zf->filename,&info)<0) {
+    U8_CLEAR_ERRNO();
+    return zipfile;}
+  u8_lock_mutex(&zipshared_lock);
+  entry = zipshared;
+  while (entry) {
+    if ( (zipshared_samep(entry,&info)) &&
+	 (zipshare_opts_samep(&(entry->opts),opts)) ) {
+      struct KNO_ZIPFILE *existing = (struct KNO_ZIPFILE *) entry->zipfile;
+      existing->share_count++;
+      kno_incref(entry->zipfile);
+      u8_unlock_mutex(&zipshared_lock);
+      kno_decref(zipfile);
+      return (lispval) existing;}
+    else entry = entry->next;}
+  entry = u8_alloc(struct KNO_ZIPSHARED);
+  entry->path = u8_strdup(zf->filename);
+  entry->opts = *opts;
+  entry->dev = info.st_dev; entry->ino = info.st_ino;
+  entry->size = info.st_size; entry->mtime = info.st_mtime;
+  entry->zipfile = kno_incref(zipfile);
+  entry->next = zipshared;
+  zipshared = entry;
+  zf->share_count = 1;
+  u8_unlock_mutex(&zipshared_lock);
+  return zipfile;
+}
+
+/* Gives up one share of *zf*, returning 1 if other shares are still
+   open (so it shouldn't be closed) and 0 otherwise, in which case it's
+   also dropped from the registry. */
+static int zipshared_release(struct KNO_ZIPFILE *zf)
+{
+  struct KNO_ZIPSHARED **ptr;
+  u8_lock_mutex(&zipshared_lock);
+  if (zf->share_count>1) {
+    zf->share_count--;
+    u8_unlock_mutex(&zipshared_lock);
+    return 1;}
+  else if (zf->share_count == 0) {
+    u8_unlock_mutex(&zipshared_lock);
+    return 0;}
+  zf->share_count = 0;
+  ptr = &zipshared;
+  while (*ptr) {
+    if ((*ptr)->zipfile == ((lispval)zf))
+      zipshared_drop(ptr);
+    else ptr = &((*ptr)->next);}
+  u8_unlock_mutex(&zipshared_lock);
+  return 0;
+}
+
+DEFC_PRIM("zip/unshare!",zipunshare_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "drops *filename* (or, by default, every archive) from the "
+	  "registry of shared zipfiles, returning the number dropped. "
+	  "Zipfiles which are still referenced stay open.",
+	  {"filename",kno_any_type,KNO_VOID})
+static lispval zipunshare_prim(lispval filename)
+{
+  u8_string abspath = (KNO_STRINGP(filename)) ?
+    (u8_abspath(KNO_CSTRING(filename),NULL)) : (NULL);
+  struct KNO_ZIPSHARED **ptr;
+  long long dropped = 0;
+  if ( (abspath == NULL) && (!(KNO_VOIDP(filename))) &&
+       (!(KNO_FALSEP(filename))) )
+    return kno_type_error("string","zipunshare_prim",filename);
+  u8_lock_mutex(&zipshared_lock);
+  ptr = &zipshared;
+  while (*ptr) {
+    if ( (abspath == NULL) || (strcmp((*ptr)->path,abspath) == 0) ) {
+      zipshared_drop(ptr);
+      dropped++;}
+    else ptr = &((*ptr)->next);}
+  u8_unlock_mutex(&zipshared_lock);
+  if (abspath) u8_free(abspath);
+  return KNO_INT2LISP(dropped);
+}
+
 DEFC_PRIM("zip/open",zipopen_prim,
 	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
+	  "opens the zip archive *filename*. *opts* is either an "
+	  "options table (or a pair of them) with the options `create` "
+	  "and `readonly`, or any other value, which as before creates "
+	  "the archive if it doesn't exist unless it's #f. Read-only zipfiles can't be modified but "
+	  "give each reading thread its own handle. "
+	  "For writable zipfiles, `threads` is the number of threads "
+	  "used to compress added entries when committing, and "
+	  "`autostore` makes the `auto` compression method the "
+	  "default. With `append`, commits which only add new "
+	  "entries write them and a new central directory at the end "
+	  "of the file, leaving the old archive intact until the new "
+	  "directory is on disk. The old directory is left as unused "
+	  "space, and once that's more than half of the file the "
+	  "commit rewrites the whole archive. `cache` is a byte budget for "
+	  "caching decoded entries. Read-only zipfiles opened with "
+	  "`shared` (the default if ZIPSHARED is set) reuse an "
+	  "already open zipfile for the same unchanged file opened "
+	  "with the same `nocheck`, `lazy`, `cache` and "
+	  "`readers` options; zip/close! on a shared zipfile only "
+	  "closes it once every zip/open which returned it has been "
+	  "closed. "
+	  "`nocheck` skips libzip's consistency checks when opening, "
+	  "and `lazy` builds the entry directory when it's first "
+	  "needed rather than when opening. With `dedup` (the default "
+	  "if ZIPDEDUP is set), identical added content is only "
+	  "compressed once when committing.",
 	  {"filename",kno_string_type,KNO_VOID},
-	  {"create",kno_any_type,KNO_FALSE})
-static lispval zipopen_prim(lispval filename,lispval create)
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipopen_prim(lispval filename,lispval opts)
 {
-  if ((KNO_FALSEP(create))||(KNO_VOIDP(create)))
-    return zipopen(KNO_CSTRING(filename),ZIP_CHECKCONS,0);
-  else return zipopen(KNO_CSTRING(filename),ZIP_CHECKCONS,ZIP_CREATE);
+  if ((KNO_FALSEP(opts))||(KNO_VOIDP(opts)))
+    return zipopen(KNO_CSTRING(filename),ZIP_CHECKCONS,0,0,0);
+  else if ( (KNO_TABLEP(opts)) ||
+	    ( (KNO_PAIRP(opts)) && (KNO_TABLEP(KNO_CAR(opts))) ) ) {
+    int readonly = zipopt(opts,readonly_symbol);
+    int create = (readonly) ? (0) : (zipopt(opts,create_symbol));
+    int nocheck = zipopt(opts,nocheck_symbol);
+    int lazy = zipopt(opts,lazy_symbol);
+    lispval share_opt = kno_getopt(opts,shared_symbol,KNO_VOID);
+    int shared = (readonly) &&
+      ( (KNO_VOIDP(share_opt)) ? (zipfile_shared) :
+	(!(KNO_FALSEP(share_opt))) );
+    struct KNO_ZIPSHARE_OPTS shareopts;
+    lispval zipfile;
+    kno_decref(share_opt);
+    if (shared) {
+      u8_string abspath = u8_abspath(KNO_CSTRING(filename),NULL);
+      lispval existing;
+      zipshare_opts(opts,nocheck,lazy,&shareopts);
+      existing = zipshared_get(abspath,&shareopts);
+      u8_free(abspath);
+      if (!(KNO_VOIDP(existing))) return existing;}
+    zipfile = zipopen(KNO_CSTRING(filename),
+		      ((nocheck)?(0):(ZIP_CHECKCONS)),
+		      ((create)?(ZIP_CREATE):(0)),readonly,lazy);
+    if (!(KNO_ABORTP(zipfile)))
+      zipfile_setopts(kno_consptr(kno_zipfile,zipfile,kno_zipfile_type),
+		      opts);
+    if ( (!(readonly)) && (!(KNO_ABORTP(zipfile))) ) {
+      struct KNO_ZIPFILE *zf =
+	kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+      zf->append_commit = zipopt(opts,append_symbol);}
+    if ( (shared) && (!(KNO_ABORTP(zipfile))) )
+      return zipshared_put(zipfile,&shareopts);
+    return zipfile;}
+  else return zipopen(KNO_CSTRING(filename),ZIP_CHECKCONS,ZIP_CREATE,0,0);
 }
 
 DEFC_PRIM("zip/make",zipmake_prim,
@@ -164,7 +1473,57 @@ DEFC_PRIM("zip/make",zipmake_prim,
 	  {"filename",kno_string_type,KNO_VOID})
 static lispval zipmake_prim(lispval filename)
 {
-  return zipopen(KNO_CSTRING(filename),0,ZIP_CREATE|ZIP_EXCL);
+  return zipopen(KNO_CSTRING(filename),0,ZIP_CREATE|ZIP_EXCL,0,0);
+}
+
+DEFC_PRIM("zip/open-packet",zipopenpacket_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "opens the zip archive in *packet*, reading it in place "
+	  "rather than through a file. The zipfile is read-only and "
+	  "takes the options `readers`, `cache`, `nocheck` and `lazy` "
+	  "as for zip/open.",
+	  {"packet",kno_packet_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipopenpacket_prim(lispval packet,lispval opts)
+{
+  int zflags = (zipopt(opts,nocheck_symbol)) ? (0) : (ZIP_CHECKCONS);
+  int lazy = zipopt(opts,lazy_symbol), errflag = 0;
+  u8_string label = zip_packet_label();
+  struct zip *zip = zip_open_packet(packet,zflags|ZIP_RDONLY,NULL,&errflag);
+  lispval zipfile;
+  U8_CLEAR_ERRNO();
+  if (zip == NULL) {
+    lispval errval = znumerr("zipopenpacket_prim",errflag,label);
+    u8_free(label);
+    return errval;}
+  zipfile = zipfile_init(zip,label,zflags,1,lazy,packet,NULL);
+  zipfile_setopts(kno_consptr(kno_zipfile,zipfile,kno_zipfile_type),opts);
+  return zipfile;
+}
+
+DEFC_PRIM("zip/make-packet",zipmakepacket_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "creates a new zip archive in memory. Committing it returns "
+	  "the archive as a packet, after which it can be read but not "
+	  "modified. *opts* can specify `threads`, `autostore`, "
+	  "`dedup` and `cache` as for zip/open.",
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipmakepacket_prim(lispval opts)
+{
+  struct zip_source *memsrc = NULL;
+  int errflag = 0;
+  u8_string label = zip_packet_label();
+  struct zip *zip =
+    zip_open_packet(KNO_VOID,ZIP_CREATE|ZIP_TRUNCATE,&memsrc,&errflag);
+  lispval zipfile;
+  U8_CLEAR_ERRNO();
+  if (zip == NULL) {
+    lispval errval = znumerr("zipmakepacket_prim",errflag,label);
+    u8_free(label);
+    return errval;}
+  zipfile = zipfile_init(zip,label,0,0,0,KNO_VOID,memsrc);
+  zipfile_setopts(kno_consptr(kno_zipfile,zipfile,kno_zipfile_type),opts);
+  return zipfile;
 }
 
 
@@ -179,26 +1538,67 @@ static lispval zipfilename_prim(lispval zipfile)
 }
 
 
+static int zipfile_precompress(struct KNO_ZIPFILE *zf);
+static int zipfile_append_commit(struct KNO_ZIPFILE *zf);
+static long long zipfile_dedup_pending(struct KNO_ZIPFILE *zf);
+
 DEFC_PRIM("zip/close!",close_zipfile,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
+	  "commits any changes to *zipfile* and closes it, returning #f "
+	  "if it was already closed. Committing an archive created with "
+	  "zip/make-packet returns its content as a packet. For a shared "
+	  "zipfile, this just gives up the caller's share unless it's "
+	  "the last one.",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID})
 static lispval close_zipfile(lispval zipfile)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  int retval;
-  u8_lock_mutex(&(zf->zipfile_lock));
+  int retval, appended = 0, empty = 0;
+  lispval result = KNO_TRUE;
+  long long start;
+  if (zipshared_release(zf))
+    return KNO_TRUE;
+  zipfile_lock(zf);
   if (zf->closed) {
     u8_unlock_mutex(&(zf->zipfile_lock));
     return KNO_FALSE;}
-  else retval = zip_close(zf->zip);
+  start = (zf->readonly) ? (0) : (zipstats_start());
+  if ( (zf->dedup) && (zf->pending) )
+    zipfile_dedup_pending(zf);
+  if ( (zf->append_commit) && (zf->pending) &&
+       (!(zf->append_blocked)) )
+    appended = zipfile_append_commit(zf);
+  if (appended<0) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return KNO_ERROR_VALUE;}
+  else if (appended) {
+    /* The additions have been written, so libzip has nothing to do */
+    zip_discard(zf->zip);
+    retval = 0;}
+  else {
+    if ( (zf->pending) && (zf->commit_threads>1) )
+      zipfile_precompress(zf);
+    if (zf->memsrc) empty = (zip_get_num_entries(zf->zip,0) == 0);
+    retval = zip_close(zf->zip);}
   if (retval) {
     u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("close_zipfile",zf,zipfile);}
+    return ziperr("close_zipfile",zf,zf->zip,zipfile);}
   else {
-    zf->closed = 1;
+    if (!(zf->readonly)) {
+      ZIPSTATS_COUNT(zf,commits,1);
+      zipstats_timed(zf,ZIPSTAT_COMMIT,start);}
+    __atomic_store_n(&(zf->closed),1,__ATOMIC_RELEASE);
+    zf->append_blocked = 0;
+    if (zf->memsrc) {
+      result = zipfile_memsrc_packet(zf,empty);
+      zip_source_free(zf->memsrc);
+      zf->memsrc = NULL;
+      if (!(KNO_ABORTP(result))) zf->packet = kno_incref(result);}
+    drop_zipdonors(zf);
+    if (!(zf->readonly)) zipdir_invalidate(zf);
     u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_TRUE;}
+    drop_zipreaders(zf);
+    return result;}
 }
 
 
@@ -209,62 +1609,304 @@ DEFC_PRIM("zip/open?",zipfile_openp,
 static lispval zipfile_openp(lispval zipfile)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  if (zf->closed) return KNO_FALSE;
+  if (zipfile_closedp(zf)) return KNO_FALSE;
   else return KNO_TRUE;
 }
 
 /* Adding to zip files */
 
+/* Forgets any automatic compression choice for *name*, called with the
+   zipfile locked */
+static void zip_auto_forget(struct KNO_ZIPFILE *zf,u8_string name)
+{
+  if (!(KNO_EMPTYP(zf->autochoices))) {
+    lispval key = kno_mkstring(name);
+    kno_drop(zf->autochoices,key,KNO_VOID);
+    kno_decref(key);}
+}
+
 static long long int zipadd
 (struct KNO_ZIPFILE *zf,u8_string name,struct zip_source *zsource)
 {
-  long long int index = zip_name_locate(zf->zip,name,0), retval = -1;
-  if (index<0) retval = index = zip_add(zf->zip,name,zsource);
-  else retval = zip_replace(zf->zip,index,zsource);
+  struct KNO_ZIPENTRY entry;
+  long long int index = -1, retval = -1;
+  if (zipfile_lookup(zf,zf->zip,name,&entry)>0) {
+    index = entry.index;
+    zf->append_blocked = 1;
+    retval = zip_replace(zf->zip,index,zsource);}
+  else retval = index = zip_add(zf->zip,name,zsource);
+  if (retval>=0) ZIPSTATS_COUNT(zf,adds,1);
+  zipdir_invalidate(zf);
+  zip_auto_forget(zf,name);
+  if (zf->cache) zipcache_drop(zf->cache,name);
   if (retval<0) return retval;
   else return index;
 }
 
-
-DEFC_PRIM("zip/add!",zipadd_prim,
-	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
-	  "**undocumented**",
-	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID},
-	  {"value",kno_any_type,KNO_VOID},
-	  {"comment",kno_any_type,KNO_FALSE},
-	  {"compress",kno_any_type,KNO_TRUE})
-static lispval zipadd_prim(lispval zipfile,lispval filename,lispval value,
-			   lispval comment,lispval compress)
+/* Locks a writable zipfile for modification, reopening it if it has
+   been closed. Returns -1 (with the lock released) on error. */
+static int zipfile_lock_update(struct KNO_ZIPFILE *zf,lispval zipfile,
+			       u8_context cxt)
 {
-  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_string fname = KNO_CSTRING(filename);
-  unsigned char *data = NULL; size_t datalen = 0;
-  struct zip_source *zsource;
-  long long int index = -1;
-  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  if (KNO_STRINGP(value)) {
-    data = u8_strdup(KNO_CSTRING(value));
-    datalen = KNO_STRLEN(value);}
-  else if (KNO_PACKETP(value)) {
-    datalen = KNO_PACKET_LENGTH(value);
-    data = u8_malloc(datalen);
-    memcpy(data,KNO_PACKET_DATA(value),datalen);}
-  else return kno_type_error("zip source","zipadd_prim",value);
-  u8_lock_mutex(&(zf->zipfile_lock));
+  if (zf->readonly) {
+    kno_seterr(ZipFileReadOnly,cxt,zf->filename,zipfile);
+    return -1;}
+  zipfile_lock(zf);
+  if ( (zf->inmem) && (zf->memsrc == NULL) ) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    kno_seterr(ZipFileFinished,cxt,zf->filename,zipfile);
+    return -1;}
   if (zf->closed) {
     lispval errval = zipreopen(zf,1);
     if (KNO_ABORTP(errval)) {
       u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  zsource = zip_source_buffer(zf->zip,data,datalen,1);
-  if (!(zsource)) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipadd/source",zf,(lispval)zf);}
-  index = zipadd(zf,fname,zsource);
+      return -1;}}
+  return 0;
+}
+
+/* Compression methods */
+
+/* Not a real method: the method is chosen from the content */
+#define ZIP_CM_AUTO (-100)
+
+struct ZIP_COMPRESSOR {
+  u8_string name; int method;};
+
+static struct ZIP_COMPRESSOR zip_compressors[]=
+  {{"store",ZIP_CM_STORE},
+   {"deflate",ZIP_CM_DEFLATE},
+#ifdef ZIP_CM_BZIP2
+   {"bzip2",ZIP_CM_BZIP2},
+#endif
+#ifdef ZIP_CM_LZMA
+   {"lzma",ZIP_CM_LZMA},
+#endif
+#ifdef ZIP_CM_XZ
+   {"xz",ZIP_CM_XZ},
+#endif
+#ifdef ZIP_CM_ZSTD
+   {"zstd",ZIP_CM_ZSTD},
+#endif
+   {NULL,0}};
+
+static int zip_method_supportedp(int method)
+{
+  if ( (method == ZIP_CM_STORE) || (method == ZIP_CM_DEFLATE) ||
+       (method == ZIP_CM_DEFAULT) || (method == ZIP_CM_AUTO) )
+    return 1;
+#if HAVE_ZIP_COMPRESSION_METHOD_SUPPORTED
+  else return zip_compression_method_supported(method,1);
+#else
+  else return 0;
+#endif
+}
+
+static int zip_method_code(lispval name)
+{
+  u8_string pname = KNO_SYMBOL_NAME(name);
+  struct ZIP_COMPRESSOR *scan = zip_compressors;
+  if (strcmp(pname,"default") == 0) return ZIP_CM_DEFAULT;
+  else if (strcmp(pname,"auto") == 0) return ZIP_CM_AUTO;
+  while (scan->name) {
+    if (strcmp(pname,scan->name) == 0) return scan->method;
+    else scan++;}
+  return -2;
+}
+
+/* Gets the range of compression levels accepted by *method*, returning
+   0 if the method doesn't take a level. */
+static int zip_level_range(int method,int *minp,int *maxp)
+{
+  *minp = 1; *maxp = 9;
+  if ( (method == ZIP_CM_DEFAULT) || (method == ZIP_CM_AUTO) ||
+       (method == ZIP_CM_DEFLATE) )
+    return 1;
+#ifdef ZIP_CM_BZIP2
+  else if (method == ZIP_CM_BZIP2) return 1;
+#endif
+#ifdef ZIP_CM_LZMA
+  else if (method == ZIP_CM_LZMA) {
+    *minp = 0; return 1;}
+#endif
+#ifdef ZIP_CM_XZ
+  else if (method == ZIP_CM_XZ) {
+    *minp = 0; return 1;}
+#endif
+#ifdef ZIP_CM_ZSTD
+  else if (method == ZIP_CM_ZSTD) {
+    *maxp = 22; return 1;}
+#endif
+  else return 0;
+}
+
+/* Parses the *compress* argument to zip/add! and friends, which is a
+   boolean (default or stored), a deflate level, a method name, or a
+   (method . level) pair, where a level of #f means the method's
+   default. The level is returned as -1 when it isn't given. Returns -1
+   on error. */
+static int zip_compression_arg(lispval compress,int *method,int *level)
+{
+  lispval mspec = compress, lspec = KNO_VOID;
+  *method = ZIP_CM_DEFAULT; *level = -1;
+  if ( (KNO_VOIDP(compress)) || (KNO_DEFAULTP(compress)) ||
+       (compress == KNO_TRUE) )
+    return 0;
+  else if (KNO_FALSEP(compress)) {
+    *method = ZIP_CM_STORE;
+    return 0;}
+  else if (KNO_FIXNUMP(compress)) {
+    mspec = KNO_VOID; lspec = compress;}
+  else if (KNO_PAIRP(compress)) {
+    mspec = KNO_CAR(compress); lspec = KNO_CDR(compress);}
+  if (KNO_SYMBOLP(mspec)) {
+    int code = zip_method_code(mspec);
+    if (code == -2) {
+      kno_seterr(ZipBadCompression,"zip_compression_arg",
+		 KNO_SYMBOL_NAME(mspec),compress);
+      return -1;}
+    else if (!(zip_method_supportedp(code))) {
+      kno_seterr(ZipUnsupportedCompression,"zip_compression_arg",
+		 KNO_SYMBOL_NAME(mspec),compress);
+      return -1;}
+    *method = code;}
+  else if (KNO_VOIDP(mspec))
+    *method = ZIP_CM_DEFLATE;
+  else {
+    kno_type_error("zip compression","zip_compression_arg",compress);
+    return -1;}
+  if (KNO_FIXNUMP(lspec)) {
+    long long lval = KNO_FIX2INT(lspec);
+    int minlevel, maxlevel;
+    if ( (!(zip_level_range(*method,&minlevel,&maxlevel))) ||
+	 (lval<minlevel) || (lval>maxlevel) ) {
+      kno_type_error("compression level","zip_compression_arg",compress);
+      return -1;}
+    *level = lval;}
+  else if (!( (KNO_VOIDP(lspec)) || (KNO_FALSEP(lspec)) ||
+	      (KNO_DEFAULTP(lspec)) )) {
+    kno_type_error("compression level","zip_compression_arg",compress);
+    return -1;}
+  return 0;
+}
+
+/* Choosing compression automatically */
+
+/* With the `auto` method, content which looks incompressible (by its
+   extension, its magic number, or a sample of its bytes) is stored
+   rather than compressed. */
+
+static u8_string zip_compressed_suffixes[]=
+  {".jpg",".jpeg",".png",".gif",".webp",".avif",".heic",".jp2",
+   ".gz",".tgz",".bz2",".tbz",".xz",".txz",".lz",".lzma",".lz4",
+   ".zst",".br",".zip",".jar",".war",".apk",".7z",".rar",".cab",
+   ".docx",".xlsx",".pptx",".odt",".ods",".odp",".epub",
+   ".mp3",".m4a",".aac",".ogg",".opus",".flac",
+   ".mp4",".m4v",".mov",".mkv",".webm",".avi",
+   ".woff",".woff2",
+   NULL};
+
+static int zip_compressed_namep(u8_string name)
+{
+  u8_string dot = strrchr(name,'.');
+  u8_string *scan = zip_compressed_suffixes;
+  if (dot == NULL) return 0;
+  while (*scan) {
+    if (strcasecmp(dot,*scan) == 0) return 1;
+    else scan++;}
+  return 0;
+}
+
+static int zip_compressed_magicp(const unsigned char *data,size_t len)
+{
+  if (len<4) return 0;
+  else if ((data[0]==0xFF)&&(data[1]==0xD8)&&(data[2]==0xFF)) /* JPEG */
+    return 1;
+  else if (memcmp(data,"\x89PNG",4) == 0) return 1;
+  else if (memcmp(data,"GIF8",4) == 0) return 1;
+  else if ((data[0]==0x1F)&&(data[1]==0x8B)) return 1; /* gzip */
+  else if (memcmp(data,"PK\x03\x04",4) == 0) return 1;
+  else if (memcmp(data,"BZh",3) == 0) return 1;
+  else if (memcmp(data,"\xFD" "7zXZ",5) == 0) return 1;
+  else if (memcmp(data,"\x28\xB5\x2F\xFD",4) == 0) return 1; /* zstd */
+  else if (memcmp(data,"7z\xBC\xAF",4) == 0) return 1;
+  else if ((len>=12)&&(memcmp(data,"RIFF",4) == 0)&&
+	   (memcmp(data+8,"WEBP",4) == 0))
+    return 1;
+  else if ((len>=8)&&(memcmp(data+4,"ftyp",4) == 0)) /* MP4 family */
+    return 1;
+  else return 0;
+}
+
+/* Estimates the entropy of a sample in bits per byte */
+static double zip_sample_entropy(const unsigned char *data,size_t len)
+{
+  unsigned int counts[256];
+  double entropy = 0;
+  size_t i = 0;
+  if (len == 0) return 0;
+  memset(counts,0,sizeof(counts));
+  while (i<len) counts[data[i++]]++;
+  i = 0; while (i<256) {
+    if (counts[i]) {
+      double p = ((double)counts[i])/len;
+      entropy -= p*log2(p);}
+    i++;}
+  return entropy;
+}
+
+#define ZIP_AUTO_SAMPLE 65536
+#define ZIP_AUTO_TRIAL 16384
+
+/* Returns ZIP_CM_STORE if the content (of which *sample* is the
+   beginning) isn't worth compressing and ZIP_CM_DEFAULT otherwise */
+static int zip_auto_method(u8_string name,const unsigned char *sample,
+			   size_t len)
+{
+  double entropy;
+  if (zip_compressed_namep(name)) return ZIP_CM_STORE;
+  else if (sample == NULL) return ZIP_CM_DEFAULT;
+  else if (zip_compressed_magicp(sample,len)) return ZIP_CM_STORE;
+  else if (len<64) return ZIP_CM_DEFAULT;
+  if (len>ZIP_AUTO_SAMPLE) len = ZIP_AUTO_SAMPLE;
+  entropy = zip_sample_entropy(sample,len);
+  if (entropy>7.5) return ZIP_CM_STORE;
+  else if (entropy<6.0) return ZIP_CM_DEFAULT;
+  else {
+    /* Borderline, so try compressing some of it */
+    size_t trial_len = (len>ZIP_AUTO_TRIAL) ? (ZIP_AUTO_TRIAL) : (len);
+    uLongf clen = compressBound(trial_len);
+    unsigned char *cbuf = u8_malloc(clen);
+    int rv = compress2(cbuf,&clen,sample,trial_len,1);
+    u8_free(cbuf);
+    if ( (rv == Z_OK) && ((clen*100) >= (trial_len*97)) )
+      return ZIP_CM_STORE;
+    else return ZIP_CM_DEFAULT;}
+}
+
+/* Records the method chosen for *fname*, called with the zipfile
+   locked. */
+static void zip_auto_record(struct KNO_ZIPFILE *zf,u8_string fname,
+			    int method)
+{
+  lispval key = kno_mkstring(fname);
+  if (KNO_EMPTYP(zf->autochoices))
+    zf->autochoices = kno_make_slotmap(8,0,NULL);
+  kno_store(zf->autochoices,key,
+	    (method == ZIP_CM_STORE) ? (store_symbol) : (deflate_symbol));
+  kno_decref(key);
+}
+
+/* Adds *zsource* as *fname*, setting its comment and compression.
+   Called with the zipfile locked; returns the entry's index or -1. */
+static long long int zipadd_source
+(struct KNO_ZIPFILE *zf,u8_string fname,struct zip_source *zsource,
+ lispval comment,int method,int level)
+{
+  long long int index = zipadd(zf,fname,zsource);
   if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipadd",zf,(lispval)zf);}
+    zip_source_free(zsource);
+    ziperr("zipadd",zf,zf->zip,(lispval)zf);
+    return -1;}
 #if (HAVE_ZIP_SET_FILE_COMMENT)
   if (!(KNO_FALSEP(comment))) {
     int retval = -1;
@@ -281,243 +1923,3100 @@ static lispval zipadd_prim(lispval zipfile,lispval filename,lispval value,
       retval = zip_set_file_comment(zf->zip,index,out.u8_outbuf,
 				    out.u8_write-out.u8_outbuf);}
     if (retval<0) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return ziperr("zipadd/comment",zf,(lispval)zf);}}
+      ziperr("zipadd/comment",zf,zf->zip,(lispval)zf);
+      return -1;}}
 #else
   if (!(KNO_FALSEP(comment))) {
     u8_log(LOG_WARNING,"zipadd/comment",
 	   "available libzip doesn't support comment fields");}
 #endif
 #if (HAVE_ZIP_SET_FILE_COMPRESSION)
-  if (KNO_FALSEP(compress)) {
-    int retval = zip_set_file_compression(zf->zip,index,ZIP_CM_STORE,0);
+  if ( (method != ZIP_CM_DEFAULT) || (level>=0) ) {
+    /* libzip takes a level of 0 as the method's default */
+    int retval = zip_set_file_compression
+      (zf->zip,index,((method == ZIP_CM_DEFAULT)?(ZIP_CM_DEFLATE):(method)),
+       ((level<0)?(0):(level)));
     if (retval<0) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return ziperr("zipadd/nocompresss",zf,(lispval)zf);}}
+      ziperr("zipadd/compression",zf,zf->zip,(lispval)zf);
+      return -1;}}
 #else
-  if (KNO_FALSEP(compress)) {
+  if ( (method != ZIP_CM_DEFAULT) || (level>=0) ) {
     u8_log(LOG_WARNING,"zipadd/compress",
-	   "available libzip doesn't support uncompressed fields");}
+	   "available libzip doesn't support per-entry compression");}
+#endif
+  return index;
+}
+
+/* Zip sources */
+
+/* Added strings, packets, ports, binary streams and procedures are
+   all passed to libzip through zip_source_function. Ports, streams
+   and procedures are only read, a chunk at a time, when the zipfile
+   is committed. That happens inside zip_close with the zipfile
+   locked, so a procedure which uses the same zipfile will deadlock.
+
+   Buffered content is kept on the zipfile's pending list, so that
+   commits can compress it on several threads before calling
+   zip_close. A precompressed source reports itself to libzip as
+   deflated, with its size and crc, and libzip then copies the
+   compressed bytes as they are. */
+
+#define ZIPSRC_BUFFER 0
+#define ZIPSRC_PORT 1
+#define ZIPSRC_PROC 2
+#define ZIPSRC_STREAM 3
+
+#define ZIPSRC_CHUNK 65536
+
+typedef struct KNO_ZIPSRC {
+  int srctype; lispval source;
+  time_t mtime;
+  lispval chunk; const unsigned char *bytes;
+  size_t chunk_len, chunk_off;
+  unsigned char *buf;
+  int eof;
+  unsigned char *data; size_t len;
+  int method, level, precompressed, hashed;
+  u8_string name; long long index;
+  unsigned char *cdata; size_t clen;
+  unsigned int crc;
+  struct KNO_ZIPFILE *zipfile;
+  struct KNO_ZIPSRC *prev, *next;
+  zip_error_t error;} KNO_ZIPSRC;
+typedef struct KNO_ZIPSRC *kno_zipsrc;
+
+static void zipsrc_drop_chunk(struct KNO_ZIPSRC *src)
+{
+  kno_decref(src->chunk);
+  src->chunk = KNO_VOID; src->bytes = NULL;
+  src->chunk_len = src->chunk_off = 0;
+}
+
+/* Gets the next chunk of content, returning 1 if there is one, 0 at
+   the end, and -1 on error */
+static int zipsrc_next_chunk(struct KNO_ZIPSRC *src)
+{
+  zipsrc_drop_chunk(src);
+  if (src->eof) return 0;
+  else if (src->srctype == ZIPSRC_BUFFER) {
+    src->eof = 1;
+    if (src->precompressed) {
+      src->bytes = src->cdata; src->chunk_len = src->clen;}
+    else {
+      src->bytes = src->data; src->chunk_len = src->len;}
+    return (src->chunk_len>0);}
+  else if (src->srctype == ZIPSRC_PORT) {
+    struct KNO_PORT *p = (struct KNO_PORT *) src->source;
+    int got;
+    if (p->port_input == NULL) {
+      src->eof = 1; return 0;}
+    if (src->buf == NULL) src->buf = u8_malloc(ZIPSRC_CHUNK);
+    got = u8_getn(src->buf,ZIPSRC_CHUNK,p->port_input);
+    if (got<0) return -1;
+    else if (got == 0) {
+      src->eof = 1; return 0;}
+    src->bytes = src->buf;
+    src->chunk_len = got;
+    return 1;}
+  else if (src->srctype == ZIPSRC_STREAM) {
+    struct KNO_STREAM *stream = (struct KNO_STREAM *) src->source;
+    kno_inbuf in;
+    size_t got = 0;
+    if (src->buf == NULL) src->buf = u8_malloc(ZIPSRC_CHUNK);
+    kno_lock_stream(stream);
+    in = kno_readbuf(stream);
+    if (kno_request_bytes(in,ZIPSRC_CHUNK)) {
+      if (kno_read_bytes(src->buf,in,ZIPSRC_CHUNK)<0) {
+	kno_unlock_stream(stream);
+	return -1;}
+      else got = ZIPSRC_CHUNK;}
+    else {
+      /* Less than a chunk is left */
+      int c;
+      while ( (got<ZIPSRC_CHUNK) && ((c = kno_read_byte(in))>=0) )
+	src->buf[got++] = c;}
+    kno_unlock_stream(stream);
+    if (got == 0) {
+      src->eof = 1; return 0;}
+    src->bytes = src->buf;
+    src->chunk_len = got;
+    return 1;}
+  else {
+    lispval chunk = kno_apply(src->source,0,NULL);
+    if (KNO_ABORTP(chunk)) return -1;
+    else if (KNO_STRINGP(chunk)) {
+      src->bytes = KNO_CSTRING(chunk);
+      src->chunk_len = KNO_STRLEN(chunk);}
+    else if (KNO_PACKETP(chunk)) {
+      src->bytes = KNO_PACKET_DATA(chunk);
+      src->chunk_len = KNO_PACKET_LENGTH(chunk);}
+    else if ( (KNO_FALSEP(chunk)) || (KNO_EOFP(chunk)) ||
+	      (KNO_VOIDP(chunk)) || (KNO_EMPTYP(chunk)) ) {
+      src->eof = 1; return 0;}
+    else {
+      kno_type_error("string or packet","zipsrc_next_chunk",chunk);
+      kno_decref(chunk);
+      return -1;}
+    src->chunk = chunk;
+    return 1;}
+}
+
+/* Removes a source from its zipfile's pending list. Sources are only
+   freed by libzip calls made with the zipfile locked. */
+static void zipsrc_unlink(struct KNO_ZIPSRC *src)
+{
+  struct KNO_ZIPFILE *zf = src->zipfile;
+  if (zf == NULL) return;
+  if (src->prev) src->prev->next = src->next;
+  else zf->pending = src->next;
+  if (src->next) src->next->prev = src->prev;
+  src->prev = src->next = NULL;
+  src->zipfile = NULL;
+}
+
+static void zipsrc_free(struct KNO_ZIPSRC *src)
+{
+  zipsrc_unlink(src);
+  zipsrc_drop_chunk(src);
+  kno_decref(src->source);
+  if (src->name) u8_free(src->name);
+  if (src->data) u8_free(src->data);
+  if (src->cdata) u8_free(src->cdata);
+  if (src->buf) u8_free(src->buf);
+  zip_error_fini(&(src->error));
+  u8_free(src);
+}
+
+static zip_int64_t zipsrc_callback(void *ud,void *data,zip_uint64_t len,
+				   zip_source_cmd_t cmd)
+{
+  struct KNO_ZIPSRC *src = (struct KNO_ZIPSRC *)ud;
+  switch (cmd) {
+  case ZIP_SOURCE_OPEN:
+    src->eof = 0;
+    return 0;
+  case ZIP_SOURCE_READ: {
+    unsigned char *out = data;
+    zip_uint64_t copied = 0;
+    while (copied<len) {
+      if (src->chunk_off >= src->chunk_len) {
+	int next = zipsrc_next_chunk(src);
+	if (next<0) {
+	  zip_error_set(&(src->error),ZIP_ER_READ,EIO);
+	  return -1;}
+	else if (next == 0) break;
+	else continue;}
+      else {
+	size_t n = src->chunk_len-src->chunk_off;
+	if (n > (len-copied)) n = len-copied;
+	memcpy(out+copied,src->bytes+src->chunk_off,n);
+	src->chunk_off += n;
+	copied += n;}}
+    return copied;}
+  case ZIP_SOURCE_CLOSE:
+    zipsrc_drop_chunk(src);
+    return 0;
+  case ZIP_SOURCE_STAT: {
+    zip_stat_t *st = (zip_stat_t *)data;
+    zip_stat_init(st);
+    st->mtime = src->mtime;
+    st->valid |= ZIP_STAT_MTIME;
+    if (src->srctype == ZIPSRC_BUFFER) {
+      st->size = src->len;
+      st->valid |= ZIP_STAT_SIZE;}
+    if (src->precompressed) {
+      st->comp_size = src->clen;
+      st->comp_method = ZIP_CM_DEFLATE;
+      st->crc = src->crc;
+      st->valid |= ZIP_STAT_COMP_SIZE|ZIP_STAT_COMP_METHOD|ZIP_STAT_CRC;}
+    return sizeof(zip_stat_t);}
+  case ZIP_SOURCE_ERROR:
+    return zip_error_to_data(&(src->error),data,len);
+  case ZIP_SOURCE_FREE:
+    zipsrc_free(src);
+    return 0;
+  case ZIP_SOURCE_SUPPORTS:
+    return zip_source_make_command_bitmap
+      (ZIP_SOURCE_OPEN,ZIP_SOURCE_READ,ZIP_SOURCE_CLOSE,ZIP_SOURCE_STAT,
+       ZIP_SOURCE_ERROR,ZIP_SOURCE_FREE,-1);
+  default:
+    zip_error_set(&(src->error),ZIP_ER_OPNOTSUPP,0);
+    return -1;}
+}
+
+/* Makes a source for *source*, or for *data* (which the source takes
+   over) if *srctype* is ZIPSRC_BUFFER. Called with the zipfile
+   locked. */
+static struct zip_source *zipsrc_make(struct KNO_ZIPFILE *zf,int srctype,
+				      lispval source,
+				      unsigned char *data,size_t len,
+				      int method,int level,
+				      struct KNO_ZIPSRC **srcp)
+{
+  struct KNO_ZIPSRC *src = u8_alloc(struct KNO_ZIPSRC);
+  struct zip_source *zsource;
+  memset(src,0,sizeof(struct KNO_ZIPSRC));
+  src->srctype = srctype;
+  src->source = kno_incref(source);
+  src->mtime = time(NULL);
+  src->chunk = KNO_VOID;
+  src->data = data; src->len = len;
+  src->method = method;
+  src->level = (level<0) ? (zf->deflate_level) : (level);
+  src->index = -1;
+  zip_error_init(&(src->error));
+  zsource = zip_source_function(zf->zip,zipsrc_callback,src);
+  if (zsource == NULL) {
+    /* The caller still owns the data */
+    src->data = NULL;
+    zipsrc_free(src);
+    return zsource;}
+  if (srctype == ZIPSRC_BUFFER) {
+    src->zipfile = zf;
+    src->next = zf->pending;
+    if (zf->pending) zf->pending->prev = src;
+    zf->pending = src;}
+  if (srcp) *srcp = src;
+  return zsource;
+}
+
+/* Compressing on commit */
+
+static int zipsrc_deflate(struct KNO_ZIPSRC *src)
+{
+  z_stream zs;
+  uLong bound;
+  unsigned char *out;
+  memset(&zs,0,sizeof(zs));
+  if (deflateInit2(&zs,src->level,Z_DEFLATED,-MAX_WBITS,8,
+		   Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  bound = deflateBound(&zs,src->len);
+  out = u8_malloc(bound);
+  zs.next_in = src->data; zs.avail_in = src->len;
+  zs.next_out = out; zs.avail_out = bound;
+  if (deflate(&zs,Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&zs);
+    u8_free(out);
+    return -1;}
+  if (!(src->hashed))
+    src->crc = crc32(crc32(0L,Z_NULL,0),src->data,src->len);
+  src->cdata = out;
+  src->clen = zs.total_out;
+  deflateEnd(&zs);
+  /* The original content isn't needed anymore */
+  u8_free(src->data);
+  src->data = NULL;
+  src->precompressed = 1;
+  return 1;
+}
+
+/* Runs fn(i,data) for i in [0,n) on up to *n_threads* threads,
+   including the calling thread. */
+struct ZIP_PARALLEL {
+  long long n_items, next;
+  void (*fn)(long long i,void *data);
+  void *data;};
+
+static void *zip_parallel_worker(void *arg)
+{
+  struct ZIP_PARALLEL *work = (struct ZIP_PARALLEL *)arg;
+  long long i;
+  while ((i = __atomic_fetch_add(&(work->next),1,__ATOMIC_RELAXED)) <
+	 work->n_items)
+    work->fn(i,work->data);
+  return NULL;
+}
+
+static void zip_parallel(int n_threads,long long n_items,
+			 void (*fn)(long long i,void *data),void *data)
+{
+  struct ZIP_PARALLEL work = { n_items, 0, fn, data };
+  pthread_t *threads;
+  int i = 0, n_started = 0;
+  if (n_threads > n_items) n_threads = n_items;
+  if (n_threads<=1) {
+    zip_parallel_worker(&work);
+    return;}
+  threads = u8_alloc_n(n_threads-1,pthread_t);
+  while (i<(n_threads-1)) {
+    if (pthread_create(&(threads[n_started]),NULL,
+		       zip_parallel_worker,&work) == 0)
+      n_started++;
+    i++;}
+  zip_parallel_worker(&work);
+  i = 0; while (i<n_started) pthread_join(threads[i++],NULL);
+  u8_free(threads);
+}
+
+static void zipsrc_deflate_job(long long i,void *data)
+{
+  struct KNO_ZIPSRC **jobs = (struct KNO_ZIPSRC **)data;
+  zipsrc_deflate(jobs[i]);
+}
+
+/* Compresses the zipfile's pending buffers in parallel. Called with
+   the zipfile locked, just before zip_close. */
+static int zipfile_precompress(struct KNO_ZIPFILE *zf)
+{
+  struct KNO_ZIPSRC *scan = zf->pending, **jobs;
+  long long n_jobs = 0, i = 0;
+  while (scan) {
+    if ( (!(scan->precompressed)) && (scan->len>0) &&
+	 ( (scan->method == ZIP_CM_DEFAULT) ||
+	   (scan->method == ZIP_CM_DEFLATE) ) )
+      n_jobs++;
+    scan = scan->next;}
+  if (n_jobs<2) return 0;
+  jobs = u8_alloc_n(n_jobs,struct KNO_ZIPSRC *);
+  scan = zf->pending; while (scan) {
+    if ( (!(scan->precompressed)) && (scan->len>0) &&
+	 ( (scan->method == ZIP_CM_DEFAULT) ||
+	   (scan->method == ZIP_CM_DEFLATE) ) )
+      jobs[i++] = scan;
+    scan = scan->next;}
+  zip_parallel(zf->commit_threads,n_jobs,zipsrc_deflate_job,jobs);
+  u8_free(jobs);
+  return n_jobs;
+}
+
+/* Deduplicating on commit */
+
+/* Zipfiles with the `dedup` option take the crc of each buffer as it's
+   added. When committing, buffers to be deflated which have the same
+   content and level are compressed once and each copy then gets the
+   compressed bytes. Every entry still has its own copy in the
+   archive, since entries sharing data are rejected by libzip's
+   consistency checks (and by many other readers), but the copies
+   aren't compressed again. */
+
+static int zipsrc_dedupablep(struct KNO_ZIPSRC *src)
+{
+  return ( (src->hashed) && (!(src->precompressed)) && (src->len>0) &&
+	   ( (src->method == ZIP_CM_DEFAULT) ||
+	     (src->method == ZIP_CM_DEFLATE) ) );
+}
+
+/* Sorts identical content together, only comparing bytes when the
+   crcs and lengths match */
+static int zipsrc_content_cmp(const void *vx,const void *vy)
+{
+  const struct KNO_ZIPSRC *x = *((const struct KNO_ZIPSRC **)vx);
+  const struct KNO_ZIPSRC *y = *((const struct KNO_ZIPSRC **)vy);
+  if (x->crc != y->crc) return (x->crc<y->crc) ? (-1) : (1);
+  else if (x->len != y->len) return (x->len<y->len) ? (-1) : (1);
+  else if (x->level != y->level) return (x->level<y->level) ? (-1) : (1);
+  else return memcmp(x->data,y->data,x->len);
+}
+
+/* Called with the zipfile locked, before anything else is compressed.
+   Returns the number of buffers which didn't need compressing. */
+static long long zipfile_dedup_pending(struct KNO_ZIPFILE *zf)
+{
+  struct KNO_ZIPSRC *scan = zf->pending, **srcs, **leaders;
+  long long n = 0, i = 0, n_groups = 0, n_deduped = 0, *ends;
+  while (scan) {
+    if (zipsrc_dedupablep(scan)) n++;
+    scan = scan->next;}
+  if (n<2) return 0;
+  srcs = u8_alloc_n(n,struct KNO_ZIPSRC *);
+  scan = zf->pending; while (scan) {
+    if (zipsrc_dedupablep(scan)) srcs[i++] = scan;
+    scan = scan->next;}
+  qsort(srcs,n,sizeof(struct KNO_ZIPSRC *),zipsrc_content_cmp);
+  /* Find the runs of identical content. The first source in each run
+     is compressed; ends[g] is the index just past run g. */
+  leaders = u8_alloc_n(n,struct KNO_ZIPSRC *);
+  ends = u8_alloc_n(n,long long);
+  i = 0; while (i<n) {
+    long long j = i+1;
+    while ( (j<n) && (zipsrc_content_cmp(&(srcs[i]),&(srcs[j])) == 0) )
+      j++;
+    if ((j-i)>1) {
+      leaders[n_groups] = srcs[i];
+      ends[n_groups] = j;
+      n_groups++;}
+    i = j;}
+  if (n_groups)
+    zip_parallel(zf->commit_threads,n_groups,zipsrc_deflate_job,leaders);
+  i = 0; while (i<n_groups) {
+    struct KNO_ZIPSRC *leader = leaders[i];
+    long long j = ends[i]-1;
+    if (leader->precompressed) {
+      while (srcs[j] != leader) {
+	struct KNO_ZIPSRC *dup = srcs[j--];
+	dup->cdata = u8_malloc(leader->clen);
+	memcpy(dup->cdata,leader->cdata,leader->clen);
+	dup->clen = leader->clen;
+	dup->crc = leader->crc;
+	u8_free(dup->data);
+	dup->data = NULL;
+	dup->precompressed = 1;
+	ZIPSTATS_COUNT(zf,dedups,1);
+	ZIPSTATS_COUNT(zf,bytes_deduped,dup->len);
+	n_deduped++;}}
+    i++;}
+  u8_free(ends);
+  u8_free(leaders);
+  u8_free(srcs);
+  return n_deduped;
+}
+
+/* Appending commits */
+
+/* When a writable zipfile opened with the `append` option has only had
+   new entries added (from strings or packets), committing writes their
+   local headers and data after the end of the file, followed by a new
+   central directory (copying the old records) and end record. Unlike
+   zip_close, this doesn't copy the archive to a temporary file. The
+   old directory is left in place until the new one has been written
+   and synced, so a crash partway through only leaves extra bytes at
+   the end, and truncating the file to its old length recovers the
+   previous archive. Each appending commit leaves the old directory
+   behind as unused space. When the unused space would be more than
+   ZIP_APPEND_MAX_SLACK percent of the file, the commit rewrites the
+   whole archive through zip_close instead, which reclaims it. */
+
+#define ZIP_APPEND_MAX_SLACK 50
+
+/* What libzip has for an added entry, which goes in its directory
+   record */
+struct ZIP_APPENDED {
+  const char *comment; size_t comment_len;
+  unsigned int opsys, attributes;
+  time_t mtime;};
+
+/* Adds up the local headers and data of the entries in a central
+   directory, to estimate how much of the file they use. Entries whose
+   sizes are in ZIP64 extra fields make the estimate unknown (-1). */
+static int zip_count_used(long long i,const unsigned char *rec,
+			  unsigned long long local_off,void *data)
+{
+  long long *used = (long long *)data;
+  if ( (*used<0) || (zip_get32(rec+20) == 0xFFFFFFFF) )
+    *used = -1;
+  else *used += 30+zip_get16(rec+28)+zip_get32(rec+20)+
+	 ((zip_get16(rec+8)&0x08) ? (16) : (0));
+  return 0;
+}
+
+static void zip_put16(unsigned char *p,unsigned int v)
+{
+  p[0] = v&0xFF; p[1] = (v>>8)&0xFF;
+}
+static void zip_put32(unsigned char *p,unsigned int v)
+{
+  p[0] = v&0xFF; p[1] = (v>>8)&0xFF; p[2] = (v>>16)&0xFF; p[3] = (v>>24)&0xFF;
+}
+static void zip_put64(unsigned char *p,unsigned long long v)
+{
+  zip_put32(p,(unsigned int)(v&0xFFFFFFFF));
+  zip_put32(p+4,(unsigned int)(v>>32));
+}
+
+static ssize_t zip_pwrite(int fd,const unsigned char *buf,size_t n,off_t off)
+{
+  size_t done = 0;
+  while (done<n) {
+    ssize_t delta = pwrite(fd,buf+done,n-done,off+done);
+    if (delta<0) {
+      if (errno == EINTR) continue;
+      else return -1;}
+    else done += delta;}
+  return done;
+}
+
+/* Converts *t* to an MS-DOS date and time, as used in zip headers */
+static void zip_dostime(time_t t,unsigned int *dtime,unsigned int *ddate)
+{
+  struct tm tm;
+  localtime_r(&t,&tm);
+  if (tm.tm_year<80) {
+    *ddate = (1<<5)|1; *dtime = 0;}
+  else {
+    *ddate = ((tm.tm_year-80)<<9)|((tm.tm_mon+1)<<5)|tm.tm_mday;
+    *dtime = (tm.tm_hour<<11)|(tm.tm_min<<5)|(tm.tm_sec/2);}
+}
+
+static int zipsrc_index_cmp(const void *vx,const void *vy)
+{
+  const struct KNO_ZIPSRC *x = *((const struct KNO_ZIPSRC **)vx);
+  const struct KNO_ZIPSRC *y = *((const struct KNO_ZIPSRC **)vy);
+  return (x->index < y->index) ? (-1) : (x->index > y->index) ? (1) : (0);
+}
+
+/* Writes the zipfile's additions by appending, returning 1 if it did,
+   0 if the additions can't be appended (so zip_close should be used),
+   or -1 on error. Called with the zipfile locked. */
+static int zipfile_append_commit(struct KNO_ZIPFILE *zf)
+{
+  unsigned long long cd_off, cd_size, cd_count;
+  long long n_entries = zip_get_num_entries(zf->zip,0), n_added = 0, i;
+  struct KNO_ZIPSRC *scan = zf->pending, **added = NULL;
+  struct ZIP_APPENDED *info = NULL;
+  long long used = 0;
+  unsigned char *tail = NULL, *cdir = NULL, *out = NULL;
+  size_t tail_len = 0, cdir_len = 0, out_len = 0, comment_len;
+  unsigned long long write_off, new_cd_off, new_cd_size, total;
+  struct stat fileinfo;
+  off_t eocd_off;
+  int fd = open(zf->filename,O_RDWR), result = 0, zip64;
+  if (fd<0) {
+    U8_CLEAR_ERRNO();
+    return 0;}
+  if ( (fstat(fd,&fileinfo)<0) ||
+       ((eocd_off = zip_find_cdir(fd,fileinfo.st_size,
+				  &cd_off,&cd_size,&cd_count))<0) ||
+       ( (cd_off+cd_size) > ((unsigned long long)eocd_off) ) )
+    goto fallback;
+  /* Every entry past those on disk must be a buffer we're holding */
+  while (scan) {
+    if (scan->index >= 0) n_added++;
+    scan = scan->next;}
+  if ( (n_added == 0) ||
+       ((cd_count+n_added) != ((unsigned long long)n_entries)) )
+    goto fallback;
+  added = u8_alloc_n(n_added,struct KNO_ZIPSRC *);
+  info = u8_alloc_n(n_added,struct ZIP_APPENDED);
+  i = 0; scan = zf->pending; while (scan) {
+    if (scan->index >= 0) {
+      if ( (scan->index < ((long long)cd_count)) ||
+	   ( (scan->method != ZIP_CM_DEFAULT) &&
+	     (scan->method != ZIP_CM_DEFLATE) &&
+	     (scan->method != ZIP_CM_STORE) ) )
+	goto fallback;
+      added[i++] = scan;}
+    scan = scan->next;}
+  qsort(added,n_added,sizeof(struct KNO_ZIPSRC *),zipsrc_index_cmp);
+  /* Compress whatever needs it, then check the sizes */
+  if (zf->commit_threads>1) zipfile_precompress(zf);
+  i = 0; while (i<n_added) {
+    struct KNO_ZIPSRC *src = added[i];
+    zip_uint32_t clen = 0, attributes = 0;
+    zip_uint8_t opsys = ZIP_OPSYS_UNIX;
+    struct zip_stat zstat;
+    if ( (!(src->precompressed)) && (src->len>0) &&
+	 (src->method != ZIP_CM_STORE) ) {
+      if (zipsrc_deflate(src)<0) goto fallback;}
+    else if (!(src->precompressed))
+      src->crc = crc32(crc32(0L,Z_NULL,0),src->data,src->len);
+    if ( (src->len >= 0xFFFFFFFF) ||
+	 ( (src->precompressed) && (src->clen >= 0xFFFFFFFF) ) ||
+	 (strlen(src->name) > 0xFFFF) )
+      goto fallback;
+    /* Use the comment, attributes and mtime libzip has for the entry,
+       which it would have written itself */
+#if (HAVE_ZIP_SET_FILE_COMMENT)
+    info[i].comment = zip_file_get_comment(zf->zip,src->index,&clen,
+					   ZIP_FL_ENC_RAW);
+    if (info[i].comment == NULL) clen = 0;
+#else
+    info[i].comment = NULL;
 #endif
+    info[i].comment_len = clen;
+    if (zip_file_get_external_attributes
+	(zf->zip,src->index,0,&opsys,&attributes)<0) {
+      opsys = ZIP_OPSYS_UNIX;
+      attributes = ((unsigned int)0100644)<<16;}
+    info[i].opsys = opsys;
+    info[i].attributes = attributes;
+    if ( (zip_stat_index(zf->zip,src->index,0,&zstat) == 0) &&
+	 (zstat.valid&ZIP_STAT_MTIME) )
+      info[i].mtime = zstat.mtime;
+    else info[i].mtime = src->mtime;
+    cdir_len += 46+strlen(src->name)+12+clen;
+    i++;}
+  /* Keep everything from the old central directory on, to copy its
+     records and the archive comment */
+  tail_len = fileinfo.st_size-cd_off;
+  tail = u8_malloc(tail_len);
+  if (zip_pread(fd,tail,tail_len,cd_off) != (ssize_t)tail_len) {
+    u8_graberrno("zipfile_append_commit",u8_strdup(zf->filename));
+    result = -1;
+    goto done;}
+  comment_len = zip_get16(tail+(eocd_off-cd_off)+20);
+  if ((eocd_off-cd_off+22+comment_len) > tail_len)
+    goto fallback;
+  /* Rewrite everything if too much of the file would be unused */
+  if ( (zip_walk_cdir(tail,cd_size,zip_count_used,&used)<0) || (used<0) ||
+       ( (((unsigned long long)fileinfo.st_size)-used)*100 >
+	 (((unsigned long long)fileinfo.st_size)*ZIP_APPEND_MAX_SLACK) ) )
+    goto fallback;
+  /* Write the local headers and data after the end of the file */
+  write_off = fileinfo.st_size;
+  cdir = u8_malloc(cdir_len);
+  cdir_len = 0;
+  i = 0; while (i<n_added) {
+    struct KNO_ZIPSRC *src = added[i];
+    size_t namelen = strlen(src->name), hlen = 30+namelen;
+    size_t clen = info[i].comment_len;
+    unsigned int dtime, ddate, flags = 0, method, version;
+    const unsigned char *body = (src->precompressed) ? (src->cdata) :
+      (src->data);
+    size_t body_len = (src->precompressed) ? (src->clen) : (src->len);
+    unsigned char *hdr = u8_malloc(hlen), *rec;
+    u8_string name_scan = src->name;
+    while (*name_scan) {
+      if (((unsigned char)(*name_scan))>=0x80) {
+	flags |= 0x0800; break;}
+      else name_scan++;}
+    method = (src->precompressed) ? (ZIP_CM_DEFLATE) : (ZIP_CM_STORE);
+    version = (method == ZIP_CM_DEFLATE) ? (20) : (10);
+    zip_dostime(info[i].mtime,&dtime,&ddate);
+    zip_put32(hdr,ZIP_LOCAL_SIG);
+    zip_put16(hdr+4,version);
+    zip_put16(hdr+6,flags);
+    zip_put16(hdr+8,method);
+    zip_put16(hdr+10,dtime);
+    zip_put16(hdr+12,ddate);
+    zip_put32(hdr+14,src->crc);
+    zip_put32(hdr+18,body_len);
+    zip_put32(hdr+22,src->len);
+    zip_put16(hdr+26,namelen);
+    zip_put16(hdr+28,0);
+    memcpy(hdr+30,src->name,namelen);
+    if ( (zip_pwrite(fd,hdr,hlen,write_off) != (ssize_t)hlen) ||
+	 (zip_pwrite(fd,body,body_len,write_off+hlen) !=
+	  (ssize_t)body_len) ) {
+      u8_free(hdr);
+      u8_graberrno("zipfile_append_commit",u8_strdup(zf->filename));
+      result = -1;
+      goto restore;}
+    u8_free(hdr);
+    /* And make its central directory record */
+    zip64 = (write_off >= 0xFFFFFFFF);
+    rec = cdir+cdir_len;
+    zip_put32(rec,ZIP_CDIR_SIG);
+    zip_put16(rec+4,(info[i].opsys<<8)|((zip64)?(45):(version)));
+    zip_put16(rec+6,(zip64)?(45):(version));
+    zip_put16(rec+8,flags);
+    zip_put16(rec+10,method);
+    zip_put16(rec+12,dtime);
+    zip_put16(rec+14,ddate);
+    zip_put32(rec+16,src->crc);
+    zip_put32(rec+20,body_len);
+    zip_put32(rec+24,src->len);
+    zip_put16(rec+28,namelen);
+    zip_put16(rec+30,(zip64)?(12):(0));
+    zip_put16(rec+32,clen);
+    zip_put16(rec+34,0);
+    zip_put16(rec+36,0);
+    zip_put32(rec+38,info[i].attributes);
+    zip_put32(rec+42,(zip64)?(0xFFFFFFFF):(write_off));
+    memcpy(rec+46,src->name,namelen);
+    if (zip64) {
+      zip_put16(rec+46+namelen,0x0001);
+      zip_put16(rec+46+namelen+2,8);
+      zip_put64(rec+46+namelen+4,write_off);}
+    if (clen)
+      memcpy(rec+46+namelen+((zip64)?(12):(0)),info[i].comment,clen);
+    cdir_len += 46+namelen+((zip64)?(12):(0))+clen;
+    write_off += hlen+body_len;
+    i++;}
+  /* Make the old and new central directory records and the end
+     records, with ZIP64 records if anything overflows */
+  new_cd_off = write_off;
+  new_cd_size = cd_size+cdir_len;
+  total = cd_count+n_added;
+  zip64 = ( (total >= 0xFFFF) || (new_cd_off >= 0xFFFFFFFF) ||
+	    (new_cd_size >= 0xFFFFFFFF) );
+  out_len = new_cd_size+((zip64)?(56+20):(0))+22+comment_len;
+  out = u8_malloc(out_len);
+  memcpy(out,tail,cd_size);
+  memcpy(out+cd_size,cdir,cdir_len);
+  {
+    unsigned char *end = out+new_cd_size;
+    if (zip64) {
+      zip_put32(end,ZIP64_EOCD_SIG);
+      zip_put64(end+4,44);
+      zip_put16(end+12,(3<<8)|45);
+      zip_put16(end+14,45);
+      zip_put32(end+16,0);
+      zip_put32(end+20,0);
+      zip_put64(end+24,total);
+      zip_put64(end+32,total);
+      zip_put64(end+40,new_cd_size);
+      zip_put64(end+48,new_cd_off);
+      zip_put32(end+56,ZIP64_LOCATOR_SIG);
+      zip_put32(end+60,0);
+      zip_put64(end+64,new_cd_off+new_cd_size);
+      zip_put32(end+72,1);
+      end += 76;}
+    zip_put32(end,ZIP_EOCD_SIG);
+    zip_put16(end+4,0);
+    zip_put16(end+6,0);
+    zip_put16(end+8,(total >= 0xFFFF) ? (0xFFFF) : (total));
+    zip_put16(end+10,(total >= 0xFFFF) ? (0xFFFF) : (total));
+    zip_put32(end+12,(new_cd_size >= 0xFFFFFFFF) ? (0xFFFFFFFF) :
+	      (new_cd_size));
+    zip_put32(end+16,(new_cd_off >= 0xFFFFFFFF) ? (0xFFFFFFFF) :
+	      (new_cd_off));
+    zip_put16(end+20,comment_len);
+    memcpy(end+22,tail+(eocd_off-cd_off)+22,comment_len);
+  }
+  /* Sync the data and the new directory before writing the end
+     records which point to them */
+  if ( (zip_pwrite(fd,out,new_cd_size,new_cd_off) !=
+	(ssize_t)new_cd_size) ||
+       (fsync(fd)<0) ||
+       (zip_pwrite(fd,out+new_cd_size,out_len-new_cd_size,
+		   new_cd_off+new_cd_size) !=
+	(ssize_t)(out_len-new_cd_size)) ||
+       (fsync(fd)<0) ) {
+    u8_graberrno("zipfile_append_commit",u8_strdup(zf->filename));
+    result = -1;
+    goto restore;}
+  result = 1;
+  goto done;
+ restore:
+  /* Drop whatever was appended, which leaves the old archive */
+  if (ftruncate(fd,fileinfo.st_size)<0)
+    u8_log(LOG_CRIT,"zipfile_append_commit",
+	   "Couldn't truncate %s back to its old length (%lld bytes)",
+	   zf->filename,(long long)fileinfo.st_size);
+  goto done;
+ fallback:
+  result = 0;
+ done:
+  close(fd);
+  if (added) u8_free(added);
+  if (info) u8_free(info);
+  if (tail) u8_free(tail);
+  if (cdir) u8_free(cdir);
+  if (out) u8_free(out);
+  if (result<0)
+    kno_seterr(ZipFileError,"zipfile_append_commit",zf->filename,
+	       (lispval)zf);
+  else U8_CLEAR_ERRNO();
+  return result;
+}
+
+/* Adds *value* (a string, packet, port or procedure) as *fname*.
+   Called with the zipfile locked; returns the new index or -1. */
+static long long int zipadd_value(struct KNO_ZIPFILE *zf,u8_string fname,
+				  lispval value,lispval comment,
+				  lispval compress)
+{
+  unsigned char *data = NULL; size_t datalen = 0;
+  struct zip_source *zsource;
+  struct KNO_ZIPSRC *src = NULL;
+  int srctype = ZIPSRC_BUFFER, method, level, automatic = 0;
+  long long index;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  if (zip_compression_arg(compress,&method,&level)<0) return -1;
+  if ( (zf->autostore) && (method == ZIP_CM_DEFAULT) && (level<0) )
+    method = ZIP_CM_AUTO;
+  if (KNO_STRINGP(value)) {
+    data = (unsigned char *) u8_strdup(KNO_CSTRING(value));
+    datalen = KNO_STRLEN(value);}
+  else if (KNO_PACKETP(value)) {
+    datalen = KNO_PACKET_LENGTH(value);
+    data = u8_malloc(datalen);
+    memcpy(data,KNO_PACKET_DATA(value),datalen);}
+  else if (KNO_TYPEP(value,kno_port_type))
+    srctype = ZIPSRC_PORT;
+  else if (KNO_TYPEP(value,kno_stream_type))
+    srctype = ZIPSRC_STREAM;
+  else if (KNO_APPLICABLEP(value))
+    srctype = ZIPSRC_PROC;
+  else {
+    kno_type_error("zip source","zipadd_value",value);
+    return -1;}
+  if (method == ZIP_CM_AUTO) {
+    method = zip_auto_method(fname,data,datalen);
+    if (method == ZIP_CM_STORE) level = -1;
+    automatic = 1;}
+  zsource = zipsrc_make
+    (zf,srctype,((srctype == ZIPSRC_BUFFER)?(KNO_VOID):(value)),
+     data,datalen,method,level,&src);
+  if (!(zsource)) {
+    if (data) u8_free(data);
+    ziperr("zipadd/source",zf,zf->zip,(lispval)zf);
+    return -1;}
+  index = zipadd_source(zf,fname,zsource,comment,method,level);
+  if (index>=0) ZIPSTATS_COUNT(zf,bytes_added,datalen);
+  if ( (index>=0) && (srctype == ZIPSRC_BUFFER) ) {
+    /* Remembered for appending commits */
+    src->name = u8_strdup(fname);
+    src->index = index;
+    if ( (zf->dedup) && (datalen>0) ) {
+      src->crc = crc32(crc32(0L,Z_NULL,0),data,datalen);
+      src->hashed = 1;}}
+  if ( (index>=0) && (automatic) )
+    zip_auto_record(zf,fname,method);
+  return index;
+}
+
+DEFC_PRIM("zip/add!",zipadd_prim,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
+	  "adds *value* to *zipfile* as *filename*. *value* can be a "
+	  "string or packet, an input port or binary stream, or a "
+	  "procedure which returns successive chunks (strings or "
+	  "packets) of the content and #f at the end. Ports, streams "
+	  "and procedures are only read when the zipfile is committed, "
+	  "with the zipfile locked, so a procedure mustn't use the same "
+	  "zipfile. *compress* is #t "
+	  "(the default method), #f (stored), a deflate level (1-9), a "
+	  "method (store, deflate, bzip2, lzma, xz or zstd), or a "
+	  "(method . level) pair, where the level is 1-9 for deflate "
+	  "and bzip2, 0-9 for lzma and xz, 1-22 for zstd, or #f for the "
+	  "method's default. The method `auto` stores content "
+	  "which looks already compressed.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"value",kno_any_type,KNO_VOID},
+	  {"comment",kno_any_type,KNO_FALSE},
+	  {"compress",kno_any_type,KNO_TRUE})
+static lispval zipadd_prim(lispval zipfile,lispval filename,lispval value,
+			   lispval comment,lispval compress)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  long long int index = -1;
+  if (zipfile_lock_update(zf,zipfile,"zipadd_prim")<0)
+    return KNO_ERROR_VALUE;
+  index = zipadd_value(zf,KNO_CSTRING(filename),value,comment,compress);
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  if (index<0)
+    return KNO_ERROR_VALUE;
+  else return KNO_INT(index);
+}
+
+static int zipadd_pair(struct KNO_ZIPFILE *zf,lispval pair,lispval compress)
+{
+  long long index;
+  if ( (!(KNO_PAIRP(pair))) || (!(KNO_STRINGP(KNO_CAR(pair)))) ) {
+    kno_type_error("(filename . value)","zipaddmany_prim",pair);
+    return -1;}
+  index = zipadd_value(zf,KNO_CSTRING(KNO_CAR(pair)),KNO_CDR(pair),
+		       KNO_FALSE,compress);
+  if (index<0) return -1;
+  else return 1;
+}
+
+DEFC_PRIM("zip/add-many!",zipaddmany_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "adds several entries to *zipfile* while locking it once. "
+	  "*entries* is a table mapping filenames to values, or a "
+	  "choice or vector of (filename . value) pairs. Returns the "
+	  "number of entries added.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"entries",kno_any_type,KNO_VOID},
+	  {"compress",kno_any_type,KNO_TRUE})
+static lispval zipaddmany_prim(lispval zipfile,lispval entries,
+			       lispval compress)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  long long n_added = 0;
+  int err = 0;
+  if (zipfile_lock_update(zf,zipfile,"zipaddmany_prim")<0)
+    return KNO_ERROR_VALUE;
+  if (KNO_VECTORP(entries)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(entries);
+    while (i<n) {
+      if (zipadd_pair(zf,KNO_VECTOR_REF(entries,i),compress)<0) {
+	err = 1; break;}
+      n_added++; i++;}}
+  else if (KNO_PAIRP(entries)||(KNO_CHOICEP(entries))) {
+    KNO_DO_CHOICES(pair,entries) {
+      if (zipadd_pair(zf,pair,compress)<0) {
+	err = 1; KNO_STOP_DO_CHOICES; break;}
+      n_added++;}}
+  else if (KNO_TABLEP(entries)) {
+    lispval keys = kno_getkeys(entries);
+    KNO_DO_CHOICES(key,keys) {
+      lispval value = (KNO_STRINGP(key)) ?
+	(kno_get(entries,key,KNO_VOID)) : (KNO_VOID);
+      long long index = (KNO_VOIDP(value)) ? (-1) :
+	(zipadd_value(zf,KNO_CSTRING(key),value,KNO_FALSE,compress));
+      if (KNO_VOIDP(value))
+	kno_type_error("filename","zipaddmany_prim",key);
+      kno_decref(value);
+      if (index<0) {
+	err = 1; KNO_STOP_DO_CHOICES; break;}
+      n_added++;}
+    kno_decref(keys);}
+  else if (!(KNO_EMPTYP(entries))) {
+    kno_type_error("zip entries","zipaddmany_prim",entries);
+    err = 1;}
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  if (err)
+    return KNO_ERROR_VALUE;
+  else return KNO_INT(n_added);
+}
+
+DEFC_PRIM("zip/add-file!",zipaddfile_prim,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
+	  "adds the file *path* to *zipfile* as *filename*. The file "
+	  "is read when the zipfile is committed, rather than being "
+	  "loaded into memory.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"path",kno_string_type,KNO_VOID},
+	  {"comment",kno_any_type,KNO_FALSE},
+	  {"compress",kno_any_type,KNO_TRUE})
+static lispval zipaddfile_prim(lispval zipfile,lispval filename,lispval path,
+			       lispval comment,lispval compress)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  u8_string abspath = u8_abspath(KNO_CSTRING(path),NULL);
+  struct zip_source *zsource;
+  long long int index = -1;
+  int method, level, automatic = 0;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  if (zip_compression_arg(compress,&method,&level)<0) {
+    u8_free(abspath);
+    return KNO_ERROR_VALUE;}
+  if (!(u8_file_existsp(abspath))) {
+    kno_seterr(kno_FileNotFound,"zipaddfile_prim",abspath,path);
+    U8_CLEAR_ERRNO();
+    u8_free(abspath);
+    return KNO_ERROR_VALUE;}
+  if ( (zf->autostore) && (method == ZIP_CM_DEFAULT) && (level<0) )
+    method = ZIP_CM_AUTO;
+  if (method == ZIP_CM_AUTO) {
+    unsigned char *sample = u8_malloc(ZIP_AUTO_SAMPLE);
+    int fd = open(abspath,O_RDONLY);
+    ssize_t n = (fd<0) ? (-1) : (zip_pread(fd,sample,ZIP_AUTO_SAMPLE,0));
+    if (fd>=0) close(fd);
+    method = zip_auto_method(fname,((n>0)?(sample):(NULL)),
+			     ((n>0)?(n):(0)));
+    if (method == ZIP_CM_STORE) level = -1;
+    u8_free(sample);
+    U8_CLEAR_ERRNO();
+    automatic = 1;}
+  if (zipfile_lock_update(zf,zipfile,"zipaddfile_prim")<0) {
+    u8_free(abspath);
+    return KNO_ERROR_VALUE;}
+  zsource = zip_source_file(zf->zip,abspath,0,-1);
+  u8_free(abspath);
+  if (!(zsource)) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return ziperr("zipaddfile/source",zf,zf->zip,path);}
+  index = zipadd_source(zf,fname,zsource,comment,method,level);
+  if ( (index>=0) && (automatic) )
+    zip_auto_record(zf,fname,method);
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  if (index<0)
+    return KNO_ERROR_VALUE;
+  else return KNO_INT(index);
+}
+
+/* Copying entries between zipfiles */
+
+/* Gets a read handle on the archive of *from* for copying its entries
+   into *zf*, which is locked. */
+static struct zip *zipfile_donor(struct KNO_ZIPFILE *zf,
+				 struct KNO_ZIPFILE *from,u8_context cxt)
+{
+  struct KNO_ZIPDONOR *scan = zf->donors;
+  struct zip *zip;
+  int errflag = 0;
+  while (scan) {
+    if (strcmp(scan->filename,from->filename) == 0)
+      return scan->zip;
+    else scan = scan->next;}
+  zip = zipfile_open_handle
+    (from,(from->flags&(~(ZIP_CHECKCONS|ZIP_CREATE)))|ZIP_RDONLY,&errflag);
+  if (zip == NULL) {
+    znumerr(cxt,errflag,from->filename);
+    return NULL;}
+  scan = u8_alloc(struct KNO_ZIPDONOR);
+  scan->filename = u8_strdup(from->filename);
+  scan->zip = zip;
+  /* The handle reads the donor's packet, if it has one */
+  scan->packet = kno_incref(from->packet);
+  scan->next = zf->donors;
+  zf->donors = scan;
+  U8_CLEAR_ERRNO();
+  return zip;
+}
+
+/* Adds entry *index* of *donor* to *zf* as *name*, copying its
+   compressed data as it is. Called with *zf* locked. */
+static long long zipcopy_entry(struct KNO_ZIPFILE *zf,struct zip *donor,
+			       long long index,u8_string name)
+{
+  struct zip_source *zsource =
+    zip_source_zip(zf->zip,donor,index,ZIP_FL_COMPRESSED,0,-1);
+  long long result;
+  if (zsource == NULL) {
+    ziperr("zipcopy_entry",zf,zf->zip,(lispval)zf);
+    return -1;}
+  result = zipadd(zf,name,zsource);
+  if (result<0) {
+    zip_source_free(zsource);
+    ziperr("zipcopy_entry",zf,zf->zip,(lispval)zf);}
+  return result;
+}
+
+DEFC_PRIM("zip/copy-entry!",zipcopyentry_prim,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(3),
+	  "copies the entry *filename* from the zipfile *from* into "
+	  "*zipfile* (as *newname* if given), without decompressing "
+	  "it, so its method and crc are kept. The entry is read from "
+	  "*from* as last committed.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"from",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"newname",kno_any_type,KNO_VOID})
+static lispval zipcopyentry_prim(lispval zipfile,lispval from,
+				 lispval filename,lispval newname)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  struct KNO_ZIPFILE *src = kno_consptr(kno_zipfile,from,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename), name;
+  struct zip *donor;
+  long long index;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  if (KNO_STRINGP(newname))
+    name = KNO_CSTRING(newname);
+  else if ( (KNO_VOIDP(newname)) || (KNO_FALSEP(newname)) )
+    name = fname;
+  else return kno_type_error("string","zipcopyentry_prim",newname);
+  if ((name[0]=='.')&&(name[1]=='/')) name = name+2;
+  if (zipfile_lock_update(zf,zipfile,"zipcopyentry_prim")<0)
+    return KNO_ERROR_VALUE;
+  donor = zipfile_donor(zf,src,"zipcopyentry_prim");
+  if (donor == NULL) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return KNO_ERROR_VALUE;}
+  index = zip_name_locate(donor,fname,0);
+  if (index<0) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return kno_err(kno_FileNotFound,"zipcopyentry_prim",fname,from);}
+  index = zipcopy_entry(zf,donor,index,name);
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  if (index<0)
+    return KNO_ERROR_VALUE;
+  else return KNO_INT(index);
+}
+
+DEFC_PRIM("zip/merge!",zipmerge_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "copies the entries of the zipfile *from* into *zipfile* "
+	  "without decompressing them, returning the number copied. "
+	  "*opts* can give a `prefix` or `glob` which names must match, "
+	  "and `skip` to keep existing entries of *zipfile* rather than "
+	  "replacing them.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"from",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipmerge_prim(lispval zipfile,lispval from,lispval opts)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  struct KNO_ZIPFILE *src = kno_consptr(kno_zipfile,from,kno_zipfile_type);
+  lispval prefix = kno_getopt(opts,prefix_symbol,KNO_VOID);
+  lispval glob = kno_getopt(opts,glob_symbol,KNO_VOID);
+  int skip = zipopt(opts,skip_symbol);
+  u8_string prefix_string = (KNO_STRINGP(prefix)) ? (KNO_CSTRING(prefix)) :
+    (NULL);
+  u8_string pattern = (KNO_STRINGP(glob)) ? (KNO_CSTRING(glob)) : (NULL);
+  size_t prefix_len = (prefix_string) ? (strlen(prefix_string)) : (0);
+  long long i = 0, n, copied = 0;
+  lispval result = KNO_VOID;
+  struct zip *donor;
+  if (zipfile_lock_update(zf,zipfile,"zipmerge_prim")<0) {
+    result = KNO_ERROR_VALUE;
+    goto done;}
+  donor = zipfile_donor(zf,src,"zipmerge_prim");
+  if (donor == NULL) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    result = KNO_ERROR_VALUE;
+    goto done;}
+  n = zip_get_num_entries(donor,0);
+  while (i<n) {
+    struct KNO_ZIPENTRY existing;
+    u8_string name = (u8_string) zip_get_name(donor,i,0);
+    if ( (name == NULL) ||
+	 ( (prefix_string) && (strncmp(name,prefix_string,prefix_len)) ) ||
+	 ( (pattern) && (fnmatch(pattern,name,0)) ) ||
+	 ( (skip) && (zipfile_lookup(zf,zf->zip,name,&existing)>0) ) ) {
+      i++; continue;}
+    if (zipcopy_entry(zf,donor,i,name)<0) {
+      result = KNO_ERROR_VALUE;
+      break;}
+    copied++;
+    i++;}
+  U8_CLEAR_ERRNO();
   u8_unlock_mutex(&(zf->zipfile_lock));
-  return KNO_INT(index);
+  if (!(KNO_ABORTP(result))) result = KNO_INT2LISP(copied);
+ done:
+  kno_decref(prefix);
+  kno_decref(glob);
+  return result;
+}
+
+
+DEFC_PRIM("zip/drop!",zipdrop_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID})
+static lispval zipdrop_prim(lispval zipfile,lispval filename)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  struct KNO_ZIPENTRY entry;
+  long long index; int retval;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  if (zipfile_lock_update(zf,zipfile,"zipdrop_prim")<0)
+    return KNO_ERROR_VALUE;
+  if (zipfile_lookup(zf,zf->zip,fname,&entry)<=0) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return KNO_FALSE;}
+  else index = entry.index;
+  retval = zip_delete(zf->zip,index);
+  zf->append_blocked = 1;
+  zipdir_invalidate(zf);
+  zip_auto_forget(zf,fname);
+  if (zf->cache) zipcache_drop(zf->cache,fname);
+  if (retval<0) {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return ziperr("zipdrop",zf,zf->zip,(lispval)zf);}
+  else {
+    u8_unlock_mutex(&(zf->zipfile_lock));
+    return KNO_TRUE;}
+}
+
+/* Text detection */
+
+/* Content is text if it's valid UTF-8. Validation is a single pass
+   which skips runs of ASCII a vector (or a word) at a time and checks
+   any multi-byte sequences it stops at. */
+
+static const unsigned char *skip_ascii_scalar(const unsigned char *scan,
+					      const unsigned char *limit)
+{
+  while ((limit-scan)>=8) {
+    unsigned long long word;
+    memcpy(&word,scan,8);
+    if (word&0x8080808080808080ULL) break;
+    else scan += 8;}
+  while ((scan<limit)&&((*scan)<0x80)) scan++;
+  return scan;
+}
+
+#if ZIP_X86_SIMD
+static const unsigned char *skip_ascii_sse2(const unsigned char *scan,
+					    const unsigned char *limit)
+{
+  while ((limit-scan)>=16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)scan);
+    int mask = _mm_movemask_epi8(block);
+    if (mask) return scan+__builtin_ctz(mask);
+    else scan += 16;}
+  return skip_ascii_scalar(scan,limit);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *skip_ascii_avx2(const unsigned char *scan,
+					    const unsigned char *limit)
+{
+  while ((limit-scan)>=32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)scan);
+    unsigned int mask = (unsigned int) _mm256_movemask_epi8(block);
+    if (mask) return scan+__builtin_ctz(mask);
+    else scan += 32;}
+  return skip_ascii_sse2(scan,limit);
+}
+
+static const unsigned char *(*skip_ascii)
+     (const unsigned char *scan,const unsigned char *limit) =
+  skip_ascii_sse2;
+#else
+static const unsigned char *(*skip_ascii)
+     (const unsigned char *scan,const unsigned char *limit) =
+  skip_ascii_scalar;
+#endif
+
+#define UTF8_CONTP(c) (((c)&0xC0) == 0x80)
+
+/* Returns 1 if *buf* is well-formed UTF-8, rejecting overlong
+   encodings, surrogates and code points past U+10FFFF. */
+static int utf8_validp(const unsigned char *buf,size_t len)
+{
+  const unsigned char *scan = buf, *limit = buf+len;
+  while (1) {
+    unsigned int c;
+    scan = skip_ascii(scan,limit);
+    if (scan >= limit) return 1;
+    c = *scan;
+    if (c < 0xC2) return 0;
+    else if (c < 0xE0) {
+      if (((limit-scan)<2) || (!(UTF8_CONTP(scan[1])))) return 0;
+      scan += 2;}
+    else if (c < 0xF0) {
+      unsigned int lo = (c == 0xE0) ? (0xA0) : (0x80);
+      unsigned int hi = (c == 0xED) ? (0x9F) : (0xBF);
+      if (((limit-scan)<3) || (scan[1]<lo) || (scan[1]>hi) ||
+	  (!(UTF8_CONTP(scan[2]))))
+	return 0;
+      scan += 3;}
+    else if (c < 0xF5) {
+      unsigned int lo = (c == 0xF0) ? (0x90) : (0x80);
+      unsigned int hi = (c == 0xF4) ? (0x8F) : (0xBF);
+      if (((limit-scan)<4) || (scan[1]<lo) || (scan[1]>hi) ||
+	  (!(UTF8_CONTP(scan[2]))) || (!(UTF8_CONTP(scan[3]))))
+	return 0;
+      scan += 4;}
+    else return 0;}
+}
+
+static int istext(u8_byte *buf,size_t size)
+{
+  return utf8_validp((const unsigned char *)buf,size);
+}
+
+static u8_string text_ctypes[]=
+  {"application/json","application/xml","application/javascript",
+   "application/ecmascript","application/x-javascript","application/sql",
+   "application/x-sh","application/x-tex","application/yaml",
+   "application/x-yaml","application/rtf","image/svg+xml",
+   NULL};
+
+/* Interprets the *isbinary* argument to zip/get and zip/get-many. A
+   content type (such as "text/html; charset=utf-8") says whether the
+   content is text without having to look at it; anything else is
+   returned as is, with KNO_VOID meaning that the content is
+   checked. */
+static lispval zip_binary_arg(lispval isbinary)
+{
+  if (KNO_STRINGP(isbinary)) {
+    u8_string ctype = KNO_CSTRING(isbinary);
+    size_t len = strcspn(ctype,";");
+    u8_string *scan = text_ctypes;
+    if (len == 0)
+      return KNO_VOID;
+    else if (strncasecmp(ctype,"text/",5) == 0)
+      return KNO_FALSE;
+    else if (strstr(ctype,"charset="))
+      return KNO_FALSE;
+    else if ( (len>5) &&
+	      ( (strncasecmp(ctype+len-5,"+json",5) == 0) ||
+		(strncasecmp(ctype+len-4,"+xml",4) == 0) ) )
+      return KNO_FALSE;
+    while (*scan) {
+      if ( (strlen(*scan) == len) && (strncasecmp(ctype,*scan,len) == 0) )
+	return KNO_FALSE;
+      else scan++;}
+    return KNO_TRUE;}
+  else return isbinary;
+}
+
+
+/* Gets the directory entry for *name*, only taking a handle (and,
+   for writable zipfiles, the lock) when the entry directory can't be
+   used on its own. */
+static int zipfile_stat(struct KNO_ZIPFILE *zf,u8_string name,
+			struct KNO_ZIPENTRY *into,u8_context cxt)
+{
+  zipfile_ensure_dir(zf);
+  if ( (zf->readonly) && (zf->zipdir) )
+    return zipfile_lookup(zf,NULL,name,into);
+  else {
+    struct zip *zip = use_zip(zf,cxt);
+    int found;
+    if (zip == NULL) return -1;
+    found = zipfile_lookup(zf,zip,name,into);
+    if (found<0) ziperr(cxt,zf,zip,KNO_VOID);
+    release_zip(zf,zip);
+    return found;}
+}
+
+/* Reads the content of *entry* using *zip*, which the caller holds. */
+static lispval zipget_entry(struct KNO_ZIPFILE *zf,struct zip *zip,
+			    struct KNO_ZIPENTRY *entry,lispval isbinary,
+			    lispval irritant)
+{
+  struct zip_file *zfile;
+  long long start = zipstats_start();
+  if (entry->size > INT_MAX)
+    return kno_err(ZipEntryTooLarge,"zipget_entry",entry->name,irritant);
+  else if ((zfile = zip_fopen_index(zip,entry->index,0))) {
+    unsigned char *buf = u8_malloc(entry->size+1);
+    size_t size = entry->size, read = 0, togo = size;
+    zip_int64_t block = 0;
+    while ((togo>0)&&((block = zip_fread(zfile,buf+read,togo))>0)) {
+      read = read+block;
+      togo = togo-block;}
+    if (togo>0) {
+      u8_free(buf);
+      return zfilerr("zipget_entry/fread",zf,zfile,irritant);}
+    zip_fclose(zfile);
+    zipstats_timed(zf,ZIPSTAT_DECOMPRESS,start);
+    ZIPSTATS_COUNT(zf,bytes_in,entry->csize);
+    ZIPSTATS_COUNT(zf,bytes_out,size);
+    buf[size]='\0';
+    if (KNO_VOIDP(isbinary)) {
+      if (istext(buf,size))
+	return kno_init_string(NULL,size,buf);
+      else return kno_init_packet(NULL,size,buf);}
+    else if (KNO_TRUEP(isbinary))
+      return kno_init_packet(NULL,size,buf);
+    else return kno_init_string(NULL,size,buf);}
+  else return ziperr("zipget_entry/fopen",zf,zip,irritant);
+}
+
+DEFC_PRIM("zip/get",zipget_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "gets the content of *filename* in *zipfile*. If *isbinary* "
+	  "is true, this returns a packet; if it's #f, a string. It can "
+	  "also be a content type, which determines which. Otherwise, "
+	  "content which is valid UTF-8 is returned as a string.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"isbinary",kno_any_type,KNO_VOID})
+static lispval zipget_prim(lispval zipfile,lispval filename,lispval isbinary)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  struct KNO_ZIPENTRY entry; int found;
+  struct zip *zip;
+  lispval result;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  isbinary = zip_binary_arg(isbinary);
+  ZIPSTATS_COUNT(zf,gets,1);
+  zipfile_ensure_dir(zf);
+  if (zf->cache) {
+    lispval cached = zipcache_get(zf->cache,fname,isbinary,1);
+    if (!(KNO_VOIDP(cached))) return cached;}
+  zip = use_zip(zf,"zipget_prim");
+  if (zip == NULL) return KNO_ERROR_VALUE;
+  found = zipfile_lookup(zf,zip,fname,&entry);
+  if (found == 0)
+    result = KNO_FALSE;
+  else if (found<0)
+    result = ziperr("zipget_prim/stat",zf,zip,filename);
+  else result = zipget_entry(zf,zip,&entry,isbinary,filename);
+  /* Cache it before releasing a writable zipfile's lock, so that an
+     update can't come in between */
+  if ( (zf->cache) && (found>0) && (!(KNO_ABORTP(result))) )
+    zipcache_put(zf->cache,fname,result);
+  release_zip(zf,zip);
+  return result;
+}
+
+/* Batch reads */
+
+struct ZIPGET_ITEM {
+  lispval name; int pos, found;
+  struct KNO_ZIPENTRY entry;};
+
+/* Reads in archive order, to keep disk access sequential */
+static int zipget_item_cmp(const void *vx,const void *vy)
+{
+  const struct ZIPGET_ITEM *x = vx, *y = vy;
+  long long xoff = (x->entry.offset>=0) ? (x->entry.offset) : (x->entry.index);
+  long long yoff = (y->entry.offset>=0) ? (y->entry.offset) : (y->entry.index);
+  if (x->found != y->found) return (x->found) ? (-1) : (1);
+  else if (xoff<yoff) return -1;
+  else if (xoff>yoff) return 1;
+  else return 0;
+}
+
+DEFC_PRIM("zip/get-many",zipgetmany_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "gets the content of several entries, taking the zipfile's "
+	  "lock (or a read handle) once and reading in archive order. "
+	  "If *names* is a vector, this returns a vector of contents "
+	  "(#f for missing entries); otherwise it returns a slotmap "
+	  "from names to contents. *isbinary* is as for zip/get.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"names",kno_any_type,KNO_VOID},
+	  {"isbinary",kno_any_type,KNO_VOID})
+static lispval zipgetmany_prim(lispval zipfile,lispval names,
+			       lispval isbinary)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  int as_vector = KNO_VECTORP(names);
+  int i = 0, n = (as_vector) ? (KNO_VECTOR_LENGTH(names)) :
+    (KNO_CHOICE_SIZE(names));
+  struct ZIPGET_ITEM *items = u8_alloc_n((n)?(n):(1),struct ZIPGET_ITEM);
+  lispval result = (as_vector) ? (kno_make_vector(n,NULL)) :
+    (kno_make_slotmap(n,0,NULL));
+  struct zip *zip;
+  isbinary = zip_binary_arg(isbinary);
+  ZIPSTATS_COUNT(zf,gets,n);
+  zipfile_ensure_dir(zf);
+  if (as_vector) {
+    while (i<n) {
+      items[i].name = KNO_VECTOR_REF(names,i);
+      items[i].pos = i;
+      KNO_VECTOR_SET(result,i,KNO_FALSE);
+      i++;}}
+  else {
+    KNO_DO_CHOICES(name,names) {
+      items[i].name = name; items[i].pos = i; i++;}}
+  i = 0; while (i<n) {
+    if (!(KNO_STRINGP(items[i].name))) {
+      lispval bad = items[i].name;
+      u8_free(items); kno_decref(result);
+      return kno_type_error("filename","zipgetmany_prim",bad);}
+    i++;}
+  zip = use_zip(zf,"zipgetmany_prim");
+  if (zip == NULL) {
+    u8_free(items); kno_decref(result);
+    return KNO_ERROR_VALUE;}
+  i = 0; while (i<n) {
+    u8_string fname = KNO_CSTRING(items[i].name);
+    if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+    items[i].found = zipfile_lookup(zf,zip,fname,&(items[i].entry));
+    if (items[i].found<0) {
+      lispval err = ziperr("zipgetmany_prim/stat",zf,zip,items[i].name);
+      release_zip(zf,zip);
+      u8_free(items); kno_decref(result);
+      return err;}
+    i++;}
+  qsort(items,n,sizeof(struct ZIPGET_ITEM),zipget_item_cmp);
+  i = 0; while ( (i<n) && (items[i].found) ) {
+    struct KNO_ZIPENTRY *entry = &(items[i].entry);
+    lispval content = (zf->cache) ?
+      (zipcache_get(zf->cache,entry->name,isbinary,zf->readonly)) :
+      (KNO_VOID);
+    if (KNO_VOIDP(content)) {
+      content = zipget_entry(zf,zip,entry,isbinary,items[i].name);
+      if ( (zf->cache) && (!(KNO_ABORTP(content))) )
+	zipcache_put(zf->cache,entry->name,content);}
+    if (KNO_ABORTP(content)) {
+      release_zip(zf,zip);
+      u8_free(items); kno_decref(result);
+      return content;}
+    else if (as_vector)
+      KNO_VECTOR_SET(result,items[i].pos,content);
+    else {
+      kno_store(result,items[i].name,content);
+      kno_decref(content);}
+    i++;}
+  release_zip(zf,zip);
+  u8_free(items);
+  return result;
+}
+
+/* Prefetching */
+
+/* zip/prefetch queues entries to be read into a zipfile's cache by a
+   small pool of background threads, which are started as they're
+   needed up to ZIPPREFETCH and exit after ZIP_PREFETCH_IDLE seconds
+   without work. The threads go through libu8's thread init and exit
+   functions, since they use Kno's allocation and error state. Entries
+   being prefetched are marked in the cache, so zip/get waits for them
+   instead of reading them again. For
+   read-only files, it also asks the kernel to start reading the bytes
+   of the entries. */
+
+typedef struct ZIP_PREFETCH_JOB {
+  lispval zipfile; u8_string name;
+  struct ZIP_PREFETCH_JOB *next;} ZIP_PREFETCH_JOB;
+
+static struct ZIP_PREFETCH_JOB *zip_prefetch_head = NULL;
+static struct ZIP_PREFETCH_JOB *zip_prefetch_tail = NULL;
+static int zip_prefetch_workers = 0;
+static u8_mutex zip_prefetch_lock;
+static u8_condvar zip_prefetch_ready;
+
+#define ZIP_PREFETCH_IDLE 10
+
+/* Reads *name* into the cache of *zf* and settles its prefetch.
+   Errors are left for a later zip/get to report. */
+static void zip_prefetch_entry(struct KNO_ZIPFILE *zf,u8_string name)
+{
+  struct zip *zip = use_zip(zf,"zip_prefetch_entry");
+  if (zip) {
+    struct KNO_ZIPENTRY entry;
+    int found = zipfile_lookup(zf,zip,name,&entry);
+    lispval content = (found>0) ?
+      (zipget_entry(zf,zip,&entry,KNO_VOID,KNO_VOID)) : (KNO_VOID);
+    /* Cache it before releasing a writable zipfile's lock, so that an
+       update can't come in between */
+    if ( (!(KNO_ABORTP(content))) && (!(KNO_VOIDP(content))) )
+      zipcache_put(zf->cache,name,content);
+    release_zip(zf,zip);
+    if (KNO_ABORTP(content))
+      kno_clear_errors(0);
+    else kno_decref(content);}
+  else kno_clear_errors(0);
+  zipcache_settle(zf->cache,name);
+}
+
+static void *zip_prefetch_worker(void *ignored)
+{
+  u8_threadcheck();
+  while (1) {
+    struct ZIP_PREFETCH_JOB *job;
+    struct timespec deadline;
+    int timedout = 0;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec += ZIP_PREFETCH_IDLE;
+    u8_lock_mutex(&zip_prefetch_lock);
+    while ( (zip_prefetch_head == NULL) && (!(timedout)) )
+      timedout = (u8_condvar_timedwait(&zip_prefetch_ready,
+				       &zip_prefetch_lock,
+				       &deadline) == ETIMEDOUT);
+    if (zip_prefetch_head == NULL) {
+      /* Idle for too long, so go away until there's more to do */
+      zip_prefetch_workers--;
+      u8_unlock_mutex(&zip_prefetch_lock);
+      break;}
+    job = zip_prefetch_head;
+    zip_prefetch_head = job->next;
+    if (zip_prefetch_head == NULL) zip_prefetch_tail = NULL;
+    u8_unlock_mutex(&zip_prefetch_lock);
+    zip_prefetch_entry((struct KNO_ZIPFILE *)job->zipfile,job->name);
+    kno_decref(job->zipfile);
+    u8_free(job->name);
+    u8_free(job);}
+  kno_clear_errors(0);
+  u8_threadexit();
+  return NULL;
+}
+
+/* Queues a prefetch, returning 0 if there are no workers to do it */
+static int zip_prefetch_queue(lispval zipfile,u8_string name)
+{
+  struct ZIP_PREFETCH_JOB *job;
+  u8_lock_mutex(&zip_prefetch_lock);
+  if (zip_prefetch_workers < zipfile_prefetch_threads) {
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,zip_prefetch_worker,NULL) == 0) {
+      pthread_detach(thread);
+      zip_prefetch_workers++;}
+    else U8_CLEAR_ERRNO();}
+  if (zip_prefetch_workers == 0) {
+    u8_unlock_mutex(&zip_prefetch_lock);
+    return 0;}
+  job = u8_alloc(struct ZIP_PREFETCH_JOB);
+  job->zipfile = kno_incref(zipfile);
+  job->name = u8_strdup(name);
+  job->next = NULL;
+  if (zip_prefetch_tail) zip_prefetch_tail->next = job;
+  else zip_prefetch_head = job;
+  zip_prefetch_tail = job;
+  u8_condvar_signal(&zip_prefetch_ready);
+  u8_unlock_mutex(&zip_prefetch_lock);
+  return 1;
+}
+
+/* Asks the kernel to read the local header and data of *entry*. The
+   header's extra field isn't known, so this allows for a short one. */
+static void zipfile_readahead(struct KNO_ZIPFILE *zf,int *fdp,
+			      struct KNO_ZIPENTRY *entry)
+{
+  off_t off = entry->offset;
+  size_t len = 30+strlen(entry->name)+entry->csize+256;
+  if (*fdp<0) *fdp = open(zf->filename,O_RDONLY);
+  if (*fdp>=0) posix_fadvise(*fdp,off,len,POSIX_FADV_WILLNEED);
+}
+
+DEFC_PRIM("zip/prefetch",zipprefetch_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "starts reading the entries *names* (a choice or vector of "
+	  "filenames) of *zipfile* into its cache in the background, "
+	  "returning the number queued. A zip/get of an entry being "
+	  "prefetched waits for it rather than reading it again. "
+	  "Without a cache, this only asks the system to read ahead "
+	  "(for read-only zipfiles). ZIPPREFETCH is the number of "
+	  "background threads.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"names",kno_any_type,KNO_VOID})
+static lispval zipprefetch_prim(lispval zipfile,lispval names)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  int as_vector = KNO_VECTORP(names);
+  int i = 0, n = (as_vector) ? (KNO_VECTOR_LENGTH(names)) :
+    (KNO_CHOICE_SIZE(names));
+  lispval *elts = u8_alloc_n((n)?(n):(1),lispval);
+  long long queued = 0;
+  int fd = -1;
+  if (as_vector) {
+    while (i<n) {
+      elts[i] = KNO_VECTOR_REF(names,i); i++;}}
+  else {
+    KNO_DO_CHOICES(name,names) {
+      elts[i++] = name;}}
+  i = 0; while (i<n) {
+    if (!(KNO_STRINGP(elts[i]))) {
+      lispval bad = elts[i];
+      u8_free(elts);
+      return kno_type_error("filename","zipprefetch_prim",bad);}
+    i++;}
+  zipfile_ensure_dir(zf);
+  i = 0; while (i<n) {
+    u8_string fname = KNO_CSTRING(elts[i++]);
+    if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+    /* Only read-only zipfiles have a directory which can't be
+       invalidated while we're using it */
+    if ( (zf->readonly) && (zf->zipdir) && (!(zf->inmem)) ) {
+      struct KNO_ZIPENTRY *entry = zipdir_lookup(zf->zipdir,fname);
+      if (entry == NULL) continue;
+      else if (entry->offset>=0)
+	zipfile_readahead(zf,&fd,entry);}
+    if ( (zf->cache) && (zipcache_claim(zf->cache,fname)) ) {
+      if (!(zip_prefetch_queue(zipfile,fname)))
+	zip_prefetch_entry(zf,fname);
+      queued++;}}
+  if (fd>=0) close(fd);
+  U8_CLEAR_ERRNO();
+  u8_free(elts);
+  return KNO_INT2LISP(queued);
+}
+
+
+DEFC_PRIM("zip/exists?",zipexists_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID})
+static lispval zipexists_prim(lispval zipfile,lispval filename)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  int found;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  found = zipfile_stat(zf,fname,NULL,"zipexists_prim");
+  if (found<0) return KNO_ERROR_VALUE;
+  else if (found) return KNO_TRUE;
+  else return KNO_FALSE;
+}
+
+
+DEFC_PRIM("zip/modtime",zipmodtime_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID})
+static lispval zipmodtime_prim(lispval zipfile,lispval filename)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  struct KNO_ZIPENTRY entry; int found;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  found = zipfile_stat(zf,fname,&entry,"zipmodtime_prim");
+  if (found<0) return KNO_ERROR_VALUE;
+  else if (found == 0) return KNO_FALSE;
+  else return kno_time2timestamp(entry.mtime);
+}
+
+
+DEFC_PRIM("zip/getsize",zipgetsize_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID})
+static lispval zipgetsize_prim(lispval zipfile,lispval filename)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string fname = KNO_CSTRING(filename);
+  struct KNO_ZIPENTRY entry; int found;
+  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
+  found = zipfile_stat(zf,fname,&entry,"zipgetsize_prim");
+  if (found<0) return KNO_ERROR_VALUE;
+  else if (found == 0) return KNO_FALSE;
+  else return KNO_INT2LISP(entry.size);
+}
+
+
+DEFC_PRIM("zip/getfiles",zipgetfiles_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "**undocumented**",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID})
+static lispval zipgetfiles_prim(lispval zipfile)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  struct zip *zip;
+  zipfile_ensure_dir(zf);
+  if ( (zf->readonly) && (zf->zipdir) ) {
+    struct KNO_ZIPDIR *dir = zf->zipdir;
+    lispval files = KNO_EMPTY_CHOICE;
+    long long i = 0, n = dir->n_entries;
+    while (i<n) {
+      u8_string name = dir->entries[i++].name;
+      if (name) {
+	lispval lname = kno_mkstring(name);
+	KNO_ADD_TO_CHOICE(files,lname);}}
+    return files;}
+  zip = use_zip(zf,"zipgetfiles_prim");
+  if (zip == NULL) return KNO_ERROR_VALUE;
+  else {
+    lispval files = KNO_EMPTY_CHOICE;
+    int numfiles = zip_get_num_files(zip);
+    int i = 0; while (i<numfiles) {
+      u8_string name = (u8_string)zip_get_name(zip,i,0);
+      if (!(name)) i++;
+      else {
+	lispval lname = kno_mkstring(name);
+	KNO_ADD_TO_CHOICE(files,lname);
+	i++;}}
+    release_zip(zf,zip);
+    return files;}
+}
+
+/* Listing entries */
+
+static lispval zip_method_symbol(int method)
+{
+  struct ZIP_COMPRESSOR *scan = zip_compressors;
+  while (scan->name) {
+    if (scan->method == method)
+      return kno_intern(scan->name);
+    else scan++;}
+  return KNO_INT(method);
+}
+
+/* Gets the entry at *index*, from the entry directory if there is one
+   and otherwise using *zip*. Returns 0 for deleted or unreadable
+   entries. */
+static int zipfile_entry_at(struct KNO_ZIPFILE *zf,struct zip *zip,
+			    long long index,struct KNO_ZIPENTRY *into)
+{
+  if (zf->zipdir) {
+    *into = zf->zipdir->entries[index];
+    return (into->name != NULL);}
+  else {
+    struct zip_stat zstat;
+    if ( (zip_stat_index(zip,index,0,&zstat) < 0) ||
+	 (!(zstat.valid&ZIP_STAT_NAME)) )
+      return 0;
+    memset(into,0,sizeof(struct KNO_ZIPENTRY));
+    into->name = zstat.name;
+    into->index = index;
+    into->size = zstat.size;
+    into->csize = zstat.comp_size;
+    into->mtime = zstat.mtime;
+    into->crc = zstat.crc;
+    into->method = zstat.comp_method;
+    into->encryption = zstat.encryption_method;
+    into->offset = -1;
+    return 1;}
+}
+
+#define ZIP_N_COLUMNS 6
+
+DEFC_PRIM("zip/entries",zipentries_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "lists the entries of *zipfile* in archive order, as vectors "
+	  "of the form #(name size csize mtime crc method). *opts* can "
+	  "specify a `prefix` or `glob` pattern which names must match, "
+	  "and a `start` index and `limit` on the number of archive "
+	  "entries scanned, for paging through large archives. If "
+	  "`columns` is true, this returns a slotmap of parallel "
+	  "vectors (with mtimes as seconds) and the `next` index to "
+	  "start from. If `count` is true, it just returns the number "
+	  "of matching entries.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipentries_prim(lispval zipfile,lispval opts)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  lispval prefix = kno_getopt(opts,prefix_symbol,KNO_VOID);
+  lispval glob = kno_getopt(opts,glob_symbol,KNO_VOID);
+  lispval start_arg = kno_getopt(opts,start_symbol,KNO_VOID);
+  lispval limit_arg = kno_getopt(opts,limit_symbol,KNO_VOID);
+  int columns = zipopt(opts,columns_symbol);
+  int count_only = zipopt(opts,count_symbol);
+  u8_string prefix_string = NULL, pattern = NULL;
+  size_t prefix_len = 0;
+  long long start = 0, limit = -1, n, i, end, n_matches = 0;
+  struct KNO_ZIPENTRY *matches = NULL;
+  struct zip *zip = NULL;
+  lispval result = KNO_VOID;
+  if (KNO_STRINGP(prefix)) {
+    prefix_string = KNO_CSTRING(prefix);
+    prefix_len = KNO_STRLEN(prefix);}
+  else if (!(KNO_VOIDP(prefix))) {
+    result = kno_type_error("string","zipentries_prim/prefix",prefix);
+    goto done;}
+  if (KNO_STRINGP(glob))
+    pattern = KNO_CSTRING(glob);
+  else if (!(KNO_VOIDP(glob))) {
+    result = kno_type_error("string","zipentries_prim/glob",glob);
+    goto done;}
+  if (KNO_FIXNUMP(start_arg)) start = KNO_FIX2INT(start_arg);
+  if (KNO_FIXNUMP(limit_arg)) limit = KNO_FIX2INT(limit_arg);
+  if (start<0) start = 0;
+  zipfile_ensure_dir(zf);
+  /* Readonly zipfiles with an entry directory don't need a handle */
+  if (!( (zf->readonly) && (zf->zipdir) )) {
+    zip = use_zip(zf,"zipentries_prim");
+    if (zip == NULL) {
+      result = KNO_ERROR_VALUE;
+      goto done;}}
+  n = (zf->zipdir) ? (zf->zipdir->n_entries) :
+    (zip_get_num_entries(zip,0));
+  end = ( (limit<0) || ((start+limit)>n) ) ? (n) : (start+limit);
+  if (start>end) start = end;
+  if (!(count_only))
+    matches = u8_alloc_n(((end>start)?(end-start):(1)),struct KNO_ZIPENTRY);
+  i = start; while (i<end) {
+    struct KNO_ZIPENTRY entry;
+    if ( (zipfile_entry_at(zf,zip,i,&entry)) &&
+	 ( (prefix_string == NULL) ||
+	   (strncmp(entry.name,prefix_string,prefix_len) == 0) ) &&
+	 ( (pattern == NULL) || (fnmatch(pattern,entry.name,0) == 0) ) ) {
+      if (matches) matches[n_matches] = entry;
+      n_matches++;}
+    i++;}
+  if (count_only)
+    result = KNO_INT2LISP(n_matches);
+  else if (columns) {
+    lispval cols[ZIP_N_COLUMNS];
+    int c = 0; while (c<ZIP_N_COLUMNS)
+		 cols[c++] = kno_make_vector(n_matches,NULL);
+    i = 0; while (i<n_matches) {
+      struct KNO_ZIPENTRY *entry = &(matches[i]);
+      KNO_VECTOR_SET(cols[0],i,kno_mkstring(entry->name));
+      KNO_VECTOR_SET(cols[1],i,KNO_INT2LISP(entry->size));
+      KNO_VECTOR_SET(cols[2],i,KNO_INT2LISP(entry->csize));
+      KNO_VECTOR_SET(cols[3],i,KNO_INT2LISP(entry->mtime));
+      KNO_VECTOR_SET(cols[4],i,KNO_INT2LISP(entry->crc));
+      KNO_VECTOR_SET(cols[5],i,zip_method_symbol(entry->method));
+      i++;}
+    result = kno_make_slotmap(8,0,NULL);
+    kno_store(result,kno_intern("name"),cols[0]);
+    kno_store(result,kno_intern("size"),cols[1]);
+    kno_store(result,kno_intern("csize"),cols[2]);
+    kno_store(result,kno_intern("mtime"),cols[3]);
+    kno_store(result,kno_intern("crc"),cols[4]);
+    kno_store(result,kno_intern("method"),cols[5]);
+    kno_store(result,kno_intern("next"),
+	      (end<n) ? (KNO_INT2LISP(end)) : (KNO_FALSE));
+    c = 0; while (c<ZIP_N_COLUMNS) kno_decref(cols[c++]);}
+  else {
+    result = kno_make_vector(n_matches,NULL);
+    i = 0; while (i<n_matches) {
+      struct KNO_ZIPENTRY *entry = &(matches[i]);
+      lispval record = kno_make_vector(ZIP_N_COLUMNS,NULL);
+      KNO_VECTOR_SET(record,0,kno_mkstring(entry->name));
+      KNO_VECTOR_SET(record,1,KNO_INT2LISP(entry->size));
+      KNO_VECTOR_SET(record,2,KNO_INT2LISP(entry->csize));
+      KNO_VECTOR_SET(record,3,kno_time2timestamp(entry->mtime));
+      KNO_VECTOR_SET(record,4,KNO_INT2LISP(entry->crc));
+      KNO_VECTOR_SET(record,5,zip_method_symbol(entry->method));
+      KNO_VECTOR_SET(result,i,record);
+      i++;}}
+  if (matches) u8_free(matches);
+  if (zip) release_zip(zf,zip);
+ done:
+  kno_decref(prefix);
+  kno_decref(glob);
+  kno_decref(start_arg);
+  kno_decref(limit_arg);
+  return result;
+}
+
+/* Listing directories */
+
+/* Gets the entry directory of *zf*, building it if a writable zipfile
+   has been modified. If it takes a handle, it's stored in *zipp* and
+   the caller releases it when done with the directory. */
+static struct KNO_ZIPDIR *use_zipdir(struct KNO_ZIPFILE *zf,
+				     struct zip **zipp,u8_context cxt)
+{
+  struct zip *zip;
+  *zipp = NULL;
+  zipfile_ensure_dir(zf);
+  if ( (zf->readonly) && (zf->zipdir) )
+    return zf->zipdir;
+  else if ((zip = use_zip(zf,cxt)) == NULL)
+    return NULL;
+  else if ( (zf->zipdir == NULL) && (!(zf->readonly)) )
+    zf->zipdir = make_zipdir(zf,zip);
+  *zipp = zip;
+  if (zf->zipdir == NULL) {
+    release_zip(zf,zip);
+    *zipp = NULL;
+    kno_seterr(ZipFileError,cxt,"no entry directory",(lispval)zf);}
+  return zf->zipdir;
+}
+
+/* Copies *path* with any leading "./" removed and a trailing slash
+   added if it's not empty */
+static u8_string zip_dirname(u8_string path)
+{
+  size_t len;
+  u8_string result;
+  while ((path[0]=='.')&&(path[1]=='/')) path = path+2;
+  while (path[0]=='/') path++;
+  len = strlen(path);
+  if ( (len == 0) || (path[len-1] == '/') )
+    return u8_strdup(path);
+  result = u8_malloc(len+2);
+  memcpy((char *)result,path,len);
+  ((char *)result)[len]='/';
+  ((char *)result)[len+1]='\0';
+  return result;
+}
+
+DEFC_PRIM("zip/list-dir",ziplistdir_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "lists the directory *path* of *zipfile*, returning the names "
+	  "of the entries in it and of its subdirectories (which end "
+	  "in '/'). If *recursive* is true, this returns all the entries "
+	  "under *path* instead. Both take time proportional to the "
+	  "number of names returned.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"path",kno_any_type,KNO_VOID},
+	  {"recursive",kno_any_type,KNO_FALSE})
+static lispval ziplistdir_prim(lispval zipfile,lispval path,
+			       lispval recursive)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  u8_string prefix;
+  size_t prefix_len;
+  lispval results = KNO_EMPTY_CHOICE;
+  struct zip *zip = NULL;
+  struct KNO_ZIPDIR *dir;
+  long long i, end;
+  if (KNO_STRINGP(path))
+    prefix = zip_dirname(KNO_CSTRING(path));
+  else if ( (KNO_VOIDP(path)) || (KNO_FALSEP(path)) )
+    prefix = u8_strdup("");
+  else return kno_type_error("string","ziplistdir_prim",path);
+  prefix_len = strlen(prefix);
+  dir = use_zipdir(zf,&zip,"ziplistdir_prim");
+  if (dir == NULL) {
+    u8_free(prefix);
+    return KNO_ERROR_VALUE;}
+  i = zipdir_bound(dir,prefix,prefix_len,0);
+  end = zipdir_bound(dir,prefix,prefix_len,1);
+  while (i<end) {
+    u8_string name = dir->sorted[i]->name;
+    u8_string rest = name+prefix_len;
+    u8_string slash = (KNO_FALSEP(recursive)) ? (strchr(rest,'/')) : (NULL);
+    if (*rest == '\0')
+      /* The directory's own entry */
+      i++;
+    else if (slash == NULL) {
+      lispval lname = kno_mkstring(name);
+      KNO_ADD_TO_CHOICE(results,lname);
+      i++;}
+    else {
+      /* Add the subdirectory and skip past everything under it,
+	 whose names sort before the same prefix ending with '0' */
+      size_t sublen = (slash-name)+1;
+      u8_string subdir = u8_strdup(name);
+      lispval lname = kno_make_string(NULL,sublen,subdir);
+      KNO_ADD_TO_CHOICE(results,lname);
+      ((char *)subdir)[sublen-1] = '/'+1;
+      i = zipdir_bound(dir,subdir,sublen,0);
+      u8_free(subdir);}}
+  if (zip) release_zip(zf,zip);
+  u8_free(prefix);
+  return kno_simplify_choice(results);
 }
 
-
-DEFC_PRIM("zip/drop!",zipdrop_prim,
+DEFC_PRIM("zip/count-prefix",zipcountprefix_prim,
 	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+	  "returns the number of entries in *zipfile* whose names start "
+	  "with *prefix*",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID})
-static lispval zipdrop_prim(lispval zipfile,lispval filename)
+	  {"prefix",kno_string_type,KNO_VOID})
+static lispval zipcountprefix_prim(lispval zipfile,lispval prefix)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_string fname = KNO_CSTRING(filename);
-  int index; int retval;
-  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  index = zip_name_locate(zf->zip,fname,0);
-  if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_FALSE;}
-  else retval = zip_delete(zf->zip,index);
-  if (retval<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipdrop",zf,(lispval)zf);}
+  u8_string pstring = KNO_CSTRING(prefix);
+  size_t plen;
+  struct zip *zip = NULL;
+  struct KNO_ZIPDIR *dir = use_zipdir(zf,&zip,"zipcountprefix_prim");
+  long long count;
+  if (dir == NULL) return KNO_ERROR_VALUE;
+  while ((pstring[0]=='.')&&(pstring[1]=='/')) pstring = pstring+2;
+  plen = strlen(pstring);
+  count = zipdir_bound(dir,pstring,plen,1)-zipdir_bound(dir,pstring,plen,0);
+  if (zip) release_zip(zf,zip);
+  return KNO_INT2LISP(count);
+}
+
+
+/* Streaming entries */
+
+static int zipstream_bufsize = 65536;
+
+/* Gets a handle for a zipstream, which keeps it until closed. For
+   writable zipfiles, this is a separate read-only handle, so streams
+   see the archive as last committed. */
+static struct zip *zipstream_handle(struct KNO_ZIPFILE *zf)
+{
+  if (zf->readonly)
+    return use_zip(zf,"zipstream_handle");
   else {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_TRUE;}
+    int errflag = 0;
+    struct zip *zip =
+      zipfile_open_handle(zf,(zf->flags&(~ZIP_CHECKCONS))|ZIP_RDONLY,
+			  &errflag);
+    if (zip == NULL) znumerr("zipstream_handle",errflag,zf->filename);
+    U8_CLEAR_ERRNO();
+    return zip;}
+}
+
+/* Called with the stream locked */
+static void zipstream_close(struct KNO_ZIPSTREAM *zs)
+{
+  struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *) zs->zipfile;
+  if (zs->closed) return;
+  if (zs->zfile) zip_fclose(zs->zfile);
+  if (zs->zip) {
+    if (zf->readonly)
+      release_zip(zf,zs->zip);
+    else zip_discard(zs->zip);}
+  zs->zfile = NULL; zs->zip = NULL;
+  zs->closed = 1;
+}
+
+static void recycle_zipstream(struct KNO_RAW_CONS *c)
+{
+  struct KNO_ZIPSTREAM *zs = (struct KNO_ZIPSTREAM *)c;
+  zipstream_close(zs);
+  kno_decref(zs->zipfile);
+  u8_free(zs->name);
+  u8_destroy_mutex(&(zs->stream_lock));
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
 }
 
-static int istext(u8_byte *buf,int size)
+static int unparse_zipstream(struct U8_OUTPUT *out,lispval x)
 {
-  u8_byte *scan = buf, *limit = buf+size;
-  while (scan<limit)
-    if ((*scan)>=0x80)
-      return u8_validp(scan);
-    else scan++;
+  struct KNO_ZIPSTREAM *zs = (struct KNO_ZIPSTREAM *)x;
+  struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *) zs->zipfile;
+  u8_printf(out,"#<ZIPSTREAM '%s' in '%s' %llu/%llu%s>",
+	    zs->name,zf->filename,zs->pos,zs->size,
+	    ((zs->closed)?(" closed"):""));
   return 1;
 }
 
+/* Reads up to *n* bytes from the stream into *buf*, returning the
+   number of bytes read, 0 at the end of the entry, and -1 on error.
+   Called with the stream locked. */
+static long long zipstream_read(struct KNO_ZIPSTREAM *zs,
+				unsigned char *buf,size_t n)
+{
+  zip_int64_t delta;
+  if (zs->closed) {
+    kno_seterr(ZipStreamClosed,"zipstream_read",zs->name,KNO_VOID);
+    return -1;}
+  else if (zs->pos >= zs->size) return 0;
+  delta = zip_fread(zs->zfile,buf,n);
+  if (delta<0) {
+    struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *) zs->zipfile;
+    u8_string details=
+      u8_mkstring("(%s) %s: %s",zf->filename,zs->name,
+		  zip_file_strerror(zs->zfile));
+    kno_seterr(ZipFileError,"zipstream_read",details,KNO_VOID);
+    u8_free(details);
+    return -1;}
+  zs->pos += delta;
+  return delta;
+}
 
-DEFC_PRIM("zip/get",zipget_prim,
+static lispval zipstream_open(struct KNO_ZIPFILE *zf,lispval zipfile,
+			      u8_string fname)
+{
+  struct KNO_ZIPENTRY entry;
+  struct zip_file *zfile;
+  struct zip *zip = zipstream_handle(zf);
+  int found;
+  if (zip == NULL) return KNO_ERROR_VALUE;
+  zipfile_ensure_dir(zf);
+  if ( (zf->readonly) && (zf->zipdir) )
+    found = zipfile_lookup(zf,NULL,fname,&entry);
+  else {
+    /* The primary handle of a writable zipfile may have uncommitted
+       changes, so look the entry up with the stream's own handle */
+    struct zip_stat zstat;
+    long long index = zip_name_locate(zip,fname,0);
+    if (index<0) found = 0;
+    else if (zip_stat_index(zip,index,0,&zstat)) {
+      ziperr("zipstream_open",zf,zip,KNO_VOID);
+      found = -1;}
+    else {
+      entry.index = index; entry.size = zstat.size;
+      entry.method = zstat.comp_method;
+      entry.encryption = zstat.encryption_method;
+      found = 1;}}
+  if (found<=0) {
+    if (zf->readonly) release_zip(zf,zip); else zip_discard(zip);
+    if (found<0) return KNO_ERROR_VALUE;
+    else return KNO_FALSE;}
+  zfile = zip_fopen_index(zip,entry.index,0);
+  if (zfile == NULL) {
+    lispval err = ziperr("zipstream_open",zf,zip,KNO_VOID);
+    if (zf->readonly) release_zip(zf,zip); else zip_discard(zip);
+    return err;}
+  else {
+    struct KNO_ZIPSTREAM *zs = u8_alloc(struct KNO_ZIPSTREAM);
+    KNO_INIT_FRESH_CONS(zs,kno_zipstream_type);
+    u8_init_mutex(&(zs->stream_lock));
+    zs->zipfile = kno_incref(zipfile);
+    zs->name = u8_strdup(fname);
+    zs->zip = zip; zs->zfile = zfile;
+    zs->index = entry.index;
+    zs->size = entry.size; zs->pos = 0;
+    zs->stored = ( (entry.method == ZIP_CM_STORE) &&
+		   (entry.encryption == ZIP_EM_NONE) );
+    zs->closed = 0;
+    return LISP_CONS(zs);}
+}
+
+/* Text ports over zipstreams */
+
+typedef struct KNO_ZIPINPUT {
+  struct U8_INPUT u8in;
+  lispval zipstream;} KNO_ZIPINPUT;
+
+static int zipinput_fill(struct U8_INPUT *in)
+{
+  struct KNO_ZIPINPUT *zin = (struct KNO_ZIPINPUT *)in;
+  struct KNO_ZIPSTREAM *zs = (struct KNO_ZIPSTREAM *) zin->zipstream;
+  size_t unread = in->u8_inlim-in->u8_read;
+  long long delta;
+  if ((in->u8_read>in->u8_inbuf)&&(unread))
+    memmove(in->u8_inbuf,in->u8_read,unread);
+  in->u8_read = in->u8_inbuf;
+  in->u8_inlim = in->u8_inbuf+unread;
+  u8_lock_mutex(&(zs->stream_lock));
+  delta = zipstream_read(zs,(unsigned char *)in->u8_inlim,
+			 in->u8_bufsz-unread);
+  u8_unlock_mutex(&(zs->stream_lock));
+  if (delta<0) return -1;
+  in->u8_inlim += delta;
+  *((u8_byte *)(in->u8_inlim)) = '\0';
+  return delta;
+}
+
+static int zipinput_close(struct U8_INPUT *in)
+{
+  struct KNO_ZIPINPUT *zin = (struct KNO_ZIPINPUT *)in;
+  struct KNO_ZIPSTREAM *zs = (struct KNO_ZIPSTREAM *) zin->zipstream;
+  u8_lock_mutex(&(zs->stream_lock));
+  zipstream_close(zs);
+  u8_unlock_mutex(&(zs->stream_lock));
+  kno_decref(zin->zipstream);
+  u8_free(in->u8_inbuf);
+  u8_free(zin);
+  return 1;
+}
+
+static lispval zipstream_port(lispval zipstream,int bufsize)
+{
+  struct KNO_ZIPSTREAM *zs = (struct KNO_ZIPSTREAM *) zipstream;
+  struct KNO_ZIPFILE *zf = (struct KNO_ZIPFILE *) zs->zipfile;
+  struct KNO_ZIPINPUT *zin = u8_alloc(struct KNO_ZIPINPUT);
+  u8_byte *buf = u8_malloc(bufsize+1);
+  memset(zin,0,sizeof(struct KNO_ZIPINPUT));
+  buf[0] = '\0';
+  zin->u8in.u8_bufsz = bufsize;
+  zin->u8in.u8_inbuf = zin->u8in.u8_read = zin->u8in.u8_inlim = buf;
+  zin->u8in.u8_fillfn = zipinput_fill;
+  zin->u8in.u8_closefn = zipinput_close;
+  zin->zipstream = zipstream;
+  return kno_make_port((u8_input)zin,NULL,
+		       u8_mkstring("%s/%s",zf->filename,zs->name));
+}
+
+DEFC_PRIM("zip/open-entry",zipopenentry_prim,
 	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+	  "opens the entry *filename* in *zipfile* for incremental "
+	  "reading. This returns a zipstream for use with `zip/read`, "
+	  "unless *opts* specifies `text`, in which case it returns "
+	  "a text input port. `bufsize` sets the buffer size for "
+	  "text ports. Returns #f if the entry doesn't exist.",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
 	  {"filename",kno_string_type,KNO_VOID},
-	  {"isbinary",kno_any_type,KNO_VOID})
-static lispval zipget_prim(lispval zipfile,lispval filename,lispval isbinary)
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipopenentry_prim(lispval zipfile,lispval filename,
+				 lispval opts)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
   u8_string fname = KNO_CSTRING(filename);
-  struct zip_stat zstat; int zret;
-  struct zip_file *zfile;
-  int index;
+  lispval zipstream;
   if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  index = zip_name_locate(zf->zip,fname,0);
-  if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_FALSE;}
-  else if ((zret = zip_stat(zf->zip,fname,0,&zstat))) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipget_prim/stat",zf,filename);}
-  else if ((zfile = zip_fopen(zf->zip,fname,0))) {
-    unsigned char *buf = u8_malloc(zstat.size+1);
-    int size = zstat.size, block = 0, read = 0, togo = size;
-    while ((togo>0)&&((block = zip_fread(zfile,buf+read,togo))>0)) {
-      if (block<0) break;
-      read = read+block;
-      togo = togo-block;}
-    if (togo>0) {
-      u8_free(buf);
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return zfilerr("zipget_prim/fread",zf,zfile,filename);}
-    zip_fclose(zfile);
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    buf[zstat.size]='\0';
-    if (KNO_VOIDP(isbinary)) {
-      if (istext(buf,size))
-	return kno_init_string(NULL,size,buf);
-      else return kno_init_packet(NULL,size,buf);}
-    else if (KNO_TRUEP(isbinary))
-      return kno_init_packet(NULL,size,buf);
-    else return kno_init_string(NULL,size,buf);}
-  else {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipget_prim/fopen",zf,filename);}
+  zipstream = zipstream_open(zf,zipfile,fname);
+  if ( (KNO_ABORTP(zipstream)) || (KNO_FALSEP(zipstream)) )
+    return zipstream;
+  else if (zipopt(opts,text_symbol)) {
+    lispval bufsize = kno_getopt(opts,bufsize_symbol,KNO_VOID);
+    int size = ( (KNO_FIXNUMP(bufsize)) && (KNO_FIX2INT(bufsize)>16) ) ?
+      (KNO_FIX2INT(bufsize)) : (zipstream_bufsize);
+    kno_decref(bufsize);
+    return zipstream_port(zipstream,size);}
+  else return zipstream;
 }
 
+DEFC_PRIM("zip/read",zipread_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "reads up to *n* bytes from *zipstream*, returning a packet, "
+	  "or #eof at the end of the entry.",
+	  {"zipstream",KNO_ZIPSTREAM_TYPE,KNO_VOID},
+	  {"n",kno_fixnum_type,KNO_VOID})
+static lispval zipread_prim(lispval zipstream,lispval n)
+{
+  struct KNO_ZIPSTREAM *zs =
+    kno_consptr(kno_zipstream,zipstream,kno_zipstream_type);
+  long long want = (KNO_FIXNUMP(n)) ? (KNO_FIX2INT(n)) : (zipstream_bufsize);
+  long long got = 0, delta = 0;
+  unsigned char *buf;
+  if (want<=0)
+    return kno_type_error("positive fixnum","zipread_prim",n);
+  u8_lock_mutex(&(zs->stream_lock));
+  if (want > (zs->size-zs->pos)) want = zs->size-zs->pos;
+  if (want == 0) {
+    u8_unlock_mutex(&(zs->stream_lock));
+    return KNO_EOF;}
+  buf = u8_malloc(want+1);
+  while ( (got<want) &&
+	  ((delta = zipstream_read(zs,buf+got,want-got))>0) )
+    got += delta;
+  u8_unlock_mutex(&(zs->stream_lock));
+  if (delta<0) {
+    u8_free(buf);
+    return KNO_ERROR_VALUE;}
+  else if (got == 0) {
+    u8_free(buf);
+    return KNO_EOF;}
+  else return kno_init_packet(NULL,got,buf);
+}
 
-DEFC_PRIM("zip/exists?",zipexists_prim,
+DEFC_PRIM("zip/seek!",zipseek_prim,
 	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+	  "moves *zipstream* to byte offset *pos*. Streams over stored "
+	  "entries can seek anywhere; compressed entries can only "
+	  "seek forward, by reading.",
+	  {"zipstream",KNO_ZIPSTREAM_TYPE,KNO_VOID},
+	  {"pos",kno_any_type,KNO_VOID})
+static lispval zipseek_prim(lispval zipstream,lispval pos)
+{
+  struct KNO_ZIPSTREAM *zs =
+    kno_consptr(kno_zipstream,zipstream,kno_zipstream_type);
+  long long off = (KNO_FIXNUMP(pos)) ? (KNO_FIX2INT(pos)) : (-1);
+  if ( (off<0) || (off > zs->size) )
+    return kno_type_error("zipstream offset","zipseek_prim",pos);
+  u8_lock_mutex(&(zs->stream_lock));
+  if (zs->closed) {
+    u8_unlock_mutex(&(zs->stream_lock));
+    return kno_err(ZipStreamClosed,"zipseek_prim",zs->name,zipstream);}
+  else if (zs->stored) {
+    if (zip_fseek(zs->zfile,off,SEEK_SET)<0) {
+      u8_string details = u8_mkstring("%s: %s",zs->name,
+				      zip_file_strerror(zs->zfile));
+      u8_unlock_mutex(&(zs->stream_lock));
+      return kno_err(ZipFileError,"zipseek_prim",details,zipstream);}
+    zs->pos = off;}
+  else if (off < zs->pos) {
+    u8_unlock_mutex(&(zs->stream_lock));
+    return kno_err(ZipStreamCantSeek,"zipseek_prim",zs->name,pos);}
+  else {
+    unsigned char buf[16384];
+    while (zs->pos < off) {
+      size_t skip = off-zs->pos;
+      if (skip>sizeof(buf)) skip = sizeof(buf);
+      if (zipstream_read(zs,buf,skip)<=0) {
+	u8_unlock_mutex(&(zs->stream_lock));
+	return KNO_ERROR_VALUE;}}}
+  u8_unlock_mutex(&(zs->stream_lock));
+  return KNO_INT2LISP(zs->pos);
+}
+
+DEFC_PRIM("zip/tell",ziptell_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "returns the current offset of *zipstream*",
+	  {"zipstream",KNO_ZIPSTREAM_TYPE,KNO_VOID})
+static lispval ziptell_prim(lispval zipstream)
+{
+  struct KNO_ZIPSTREAM *zs =
+    kno_consptr(kno_zipstream,zipstream,kno_zipstream_type);
+  return KNO_INT2LISP(zs->pos);
+}
+
+DEFC_PRIM("zip/close-entry!",zipcloseentry_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "closes *zipstream*, releasing its handle",
+	  {"zipstream",KNO_ZIPSTREAM_TYPE,KNO_VOID})
+static lispval zipcloseentry_prim(lispval zipstream)
+{
+  struct KNO_ZIPSTREAM *zs =
+    kno_consptr(kno_zipstream,zipstream,kno_zipstream_type);
+  int was_closed;
+  u8_lock_mutex(&(zs->stream_lock));
+  was_closed = zs->closed;
+  zipstream_close(zs);
+  u8_unlock_mutex(&(zs->stream_lock));
+  if (was_closed) return KNO_FALSE;
+  else return KNO_TRUE;
+}
+
+/* Extracting archives */
+
+/* zip/extract-all runs on several threads, each with its own read-only
+   handle, and streams entries straight to their files through a
+   buffer of zipstream_bufsize bytes. Files and directories are opened
+   relative to the destination directory, one level at a time and
+   without following symbolic links, so links in the destination can't
+   send the extraction elsewhere. Errors are recorded per entry, and
+   reported once all the threads are done. */
+
+typedef struct ZIP_EXTRACT_ITEM {
+  u8_string name; long long index;
+  time_t mtime;
+  unsigned long long size;
+  u8_context failed; int errnum;
+  u8_string details;} ZIP_EXTRACT_ITEM;
+
+typedef struct ZIP_EXTRACTION {
+  struct KNO_ZIPFILE *zipfile;
+  u8_string dir; int dirfd;
+  struct ZIP_EXTRACT_ITEM *items;
+  long long n_items, next;
+  size_t bufsize;
+  struct zip *first;} ZIP_EXTRACTION;
+
+/* Rejects names which would be extracted outside of the destination
+   directory */
+static int zip_safe_namep(u8_string name)
+{
+  u8_string scan = name;
+  if ( (name[0] == '/') || (name[0] == '\\') || (name[0] == '\0') )
+    return 0;
+  while (*scan) {
+    u8_string end = scan;
+    while ( (*end) && (*end != '/') && (*end != '\\') ) end++;
+    if ( ((end-scan) == 2) && (scan[0] == '.') && (scan[1] == '.') )
+      return 0;
+    scan = (*end) ? (end+1) : (end);}
+  return 1;
+}
+
+/* Opens the directory containing *path* (a copy of an entry name which
+   this modifies) under *dirfd*, creating any missing directories. Each
+   level is opened relative to the one before without following
+   symbolic links. Returns the directory's descriptor, which the caller
+   closes, and sets *basep* to the last part of *path*; or returns -1
+   with errno set. */
+static int zip_extract_opendir(int dirfd,char *path,char **basep)
+{
+  char *scan = path, *slash;
+  int fd = dup(dirfd);
+  while ( (fd>=0) && ((slash = strchr(scan,'/'))) ) {
+    *slash = '\0';
+    if ( (*scan) && (strcmp(scan,".")) ) {
+      int next, saved;
+      if ( (mkdirat(fd,scan,0777)<0) && (errno != EEXIST) )
+	next = -1;
+      else next = openat(fd,scan,O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+      saved = errno;
+      close(fd);
+      errno = saved;
+      fd = next;}
+    scan = slash+1;}
+  *basep = scan;
+  return fd;
+}
+
+static int zip_extract_item(struct ZIP_EXTRACTION *ex,struct zip *zip,
+			    struct ZIP_EXTRACT_ITEM *item,unsigned char *buf)
+{
+  char *path = (char *)u8_strdup(item->name), *base = NULL;
+  struct zip_file *zfile = NULL;
+  struct timespec times[2];
+  int dfd = -1, fd = -1;
+  if (item->failed) {
+    /* Rejected before extracting */
+    u8_free(path);
+    return -1;}
+  if ((dfd = zip_extract_opendir(ex->dirfd,path,&base))<0) {
+    item->failed = "mkdir"; item->errnum = errno;
+    goto failed;}
+  if (*base == '\0') {
+    /* Just a directory */
+    close(dfd);
+    u8_free(path);
+    return 1;}
+  if ((zfile = zip_fopen_index(zip,item->index,0)) == NULL) {
+    item->failed = "zip_fopen_index";
+    item->details = u8_strdup(zip_strerror(zip));
+    goto failed;}
+  if ((fd = openat(dfd,base,O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW,0666))<0) {
+    item->failed = "open"; item->errnum = errno;
+    goto failed;}
+  while (1) {
+    zip_int64_t n = zip_fread(zfile,buf,ex->bufsize);
+    unsigned char *out = buf;
+    if (n<0) {
+      item->failed = "zip_fread";
+      item->details = u8_strdup(zip_file_strerror(zfile));
+      goto failed;}
+    else if (n == 0) break;
+    while (n>0) {
+      ssize_t written = write(fd,out,n);
+      if (written<0) {
+	if (errno == EINTR) continue;
+	item->failed = "write"; item->errnum = errno;
+	goto failed;}
+      out += written; n -= written;}}
+  zip_fclose(zfile); zfile = NULL;
+  times[0].tv_sec = times[1].tv_sec = item->mtime;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  futimens(fd,times);
+  if (close(fd)<0) {
+    fd = -1;
+    item->failed = "close"; item->errnum = errno;
+    goto failed;}
+  close(dfd);
+  u8_free(path);
+  return 1;
+ failed:
+  if (zfile) zip_fclose(zfile);
+  if (fd>=0) close(fd);
+  if (dfd>=0) close(dfd);
+  u8_free(path);
+  return -1;
+}
+
+static void zip_extract_worker(long long thread,void *data)
+{
+  struct ZIP_EXTRACTION *ex = (struct ZIP_EXTRACTION *)data;
+  struct zip *zip = NULL;
+  unsigned char *buf = u8_malloc(ex->bufsize);
+  long long i;
+  int errflag = 0;
+  if (thread == 0)
+    zip = ex->first;
+  else zip = zipfile_open_handle
+	 (ex->zipfile,(ex->zipfile->flags&(~(ZIP_CHECKCONS|ZIP_CREATE)))|
+	  ZIP_RDONLY,&errflag);
+  /* If this thread can't get a handle, the others do its share */
+  if (zip) {
+    while ((i = __atomic_fetch_add(&(ex->next),1,__ATOMIC_RELAXED)) <
+	   ex->n_items)
+      zip_extract_item(ex,zip,&(ex->items[i]),buf);
+    if (thread != 0) zip_discard(zip);}
+  u8_free(buf);
+}
+
+/* Returns 1 if *name* matches any of the globs in *patterns*, which
+   is a string or a choice of strings */
+static int zip_globs_matchp(lispval patterns,u8_string name)
+{
+  KNO_DO_CHOICES(pattern,patterns) {
+    if ( (KNO_STRINGP(pattern)) &&
+	 (fnmatch(KNO_CSTRING(pattern),name,0) == 0) ) {
+      KNO_STOP_DO_CHOICES;
+      return 1;}}
+  return 0;
+}
+
+DEFC_PRIM("zip/extract-all",zipextractall_prim,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "extracts the entries of *zipfile* (as last committed) into "
+	  "the directory *dir*, keeping their modification times. "
+	  "*opts* can give `include` and `exclude` globs (or choices "
+	  "of globs) for entry names and the number of `threads` to "
+	  "use. Entries whose names would escape *dir* aren't "
+	  "extracted, and symbolic links under *dir* aren't followed. "
+	  "This returns a slotmap with the number of entries `extracted` "
+	  "and their total `bytes`, plus `errors`, a slotmap from names "
+	  "to error messages, if any entries (including those with "
+	  "unsafe names) couldn't be extracted.",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID})
-static lispval zipexists_prim(lispval zipfile,lispval filename)
+	  {"dir",kno_string_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipextractall_prim(lispval zipfile,lispval dir,lispval opts)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_string fname = KNO_CSTRING(filename); int index;
-  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  index = zip_name_locate(zf->zip,fname,0);
-  if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_FALSE;}
+  lispval include = kno_getopt(opts,include_symbol,KNO_VOID);
+  lispval exclude = kno_getopt(opts,exclude_symbol,KNO_VOID);
+  lispval threads_arg = kno_getopt(opts,threads_symbol,KNO_VOID);
+  struct ZIP_EXTRACTION ex;
+  lispval result = KNO_VOID, errors = KNO_VOID;
+  long long i = 0, n, n_extracted = 0;
+  unsigned long long bytes = 0;
+  int errflag = 0, n_threads;
+  memset(&ex,0,sizeof(ex));
+  ex.dirfd = -1;
+  if (KNO_FIXNUMP(threads_arg))
+    n_threads = KNO_FIX2INT(threads_arg);
+  else n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads<1) n_threads = 1;
+  ex.zipfile = zf;
+  ex.bufsize = (zipstream_bufsize>0) ? (zipstream_bufsize) : (65536);
+  ex.dir = u8_abspath(KNO_CSTRING(dir),NULL);
+  if ( (!(u8_directoryp(ex.dir))) && (u8_mkdirs(ex.dir,0777)<0) ) {
+    u8_graberrno("zipextractall_prim",u8_strdup(ex.dir));
+    result = kno_err(ZipFileError,"zipextractall_prim",ex.dir,dir);
+    goto done;}
+  if ((ex.dirfd = open(ex.dir,O_RDONLY|O_DIRECTORY))<0) {
+    u8_graberrno("zipextractall_prim",u8_strdup(ex.dir));
+    result = kno_err(ZipFileError,"zipextractall_prim",ex.dir,dir);
+    goto done;}
+  ex.first = zipfile_open_handle
+    (zf,(zf->flags&(~(ZIP_CHECKCONS|ZIP_CREATE)))|ZIP_RDONLY,&errflag);
+  if (ex.first == NULL) {
+    result = znumerr("zipextractall_prim",errflag,zf->filename);
+    goto done;}
+  n = zip_get_num_entries(ex.first,0);
+  ex.items = u8_alloc_n(((n>0)?(n):(1)),struct ZIP_EXTRACT_ITEM);
+  while (i<n) {
+    struct zip_stat zstat;
+    if ( (zip_stat_index(ex.first,i,0,&zstat) == 0) &&
+	 (zstat.valid&ZIP_STAT_NAME) &&
+	 ( (KNO_VOIDP(include)) ||
+	   (zip_globs_matchp(include,zstat.name)) ) &&
+	 ( (KNO_VOIDP(exclude)) ||
+	   (!(zip_globs_matchp(exclude,zstat.name))) ) ) {
+      struct ZIP_EXTRACT_ITEM *item = &(ex.items[ex.n_items++]);
+      memset(item,0,sizeof(struct ZIP_EXTRACT_ITEM));
+      item->name = zstat.name;
+      item->index = i;
+      item->mtime = zstat.mtime;
+      item->size = zstat.size;
+      if (!(zip_safe_namep(zstat.name))) {
+	item->failed = "unsafe name";
+	item->details = u8_strdup("would be extracted outside of the "
+				  "destination directory");}}
+    i++;}
+  if (n_threads > ex.n_items) n_threads = (ex.n_items) ? (ex.n_items) : (1);
+  zip_parallel(n_threads,n_threads,zip_extract_worker,&ex);
+  i = 0; while (i<ex.n_items) {
+    struct ZIP_EXTRACT_ITEM *item = &(ex.items[i++]);
+    if (item->failed) {
+      u8_string msg = (item->details) ?
+	(u8_mkstring("%s: %s",item->failed,item->details)) :
+	(u8_mkstring("%s: %s",item->failed,strerror(item->errnum)));
+      lispval key = kno_mkstring(item->name);
+      lispval val = kno_wrapstring(msg);
+      if (KNO_VOIDP(errors)) errors = kno_make_slotmap(8,0,NULL);
+      kno_store(errors,key,val);
+      kno_decref(key); kno_decref(val);
+      if (item->details) u8_free(item->details);}
+    else {
+      n_extracted++;
+      bytes += item->size;}}
+  result = kno_make_slotmap(4,0,NULL);
+  kno_store(result,kno_intern("extracted"),KNO_INT2LISP(n_extracted));
+  kno_store(result,kno_intern("bytes"),KNO_INT2LISP(bytes));
+  if (!(KNO_VOIDP(errors))) {
+    kno_store(result,kno_intern("errors"),errors);
+    kno_decref(errors);}
+  U8_CLEAR_ERRNO();
+ done:
+  if (ex.first) zip_discard(ex.first);
+  if (ex.items) u8_free(ex.items);
+  if (ex.dirfd>=0) close(ex.dirfd);
+  u8_free(ex.dir);
+  kno_decref(include);
+  kno_decref(exclude);
+  kno_decref(threads_arg);
+  return result;
+}
+
+/* Verifying archives */
+
+/* zip/verify checks the entries of an archive (as last committed) on
+   several threads, each with its own handle and a pair of scratch
+   buffers, without keeping any of the content. Stored and deflated
+   entries are read raw and inflated here, so their crcs are only
+   computed once, by zlib's crc32. Other methods are read through
+   libzip. For archives in files, each entry's local header is
+   also checked against its central directory record. */
+
+typedef struct ZIP_VERIFY_ITEM {
+  u8_string name; long long index;
+  unsigned long long size, csize, bytes;
+  unsigned int crc; int method, encrypted;
+  long long offset;
+  u8_context failed;
+  u8_string details;} ZIP_VERIFY_ITEM;
+
+typedef struct ZIP_VERIFICATION {
+  struct KNO_ZIPFILE *zipfile;
+  struct ZIP_VERIFY_ITEM *items;
+  long long n_items, next;
+  size_t bufsize;
+  int fd; unsigned long long cd_off;
+  struct zip *first;} ZIP_VERIFICATION;
+
+static int zip_verify_set_offset(long long i,const unsigned char *rec,
+				 unsigned long long local_off,void *data)
+{
+  struct ZIP_VERIFICATION *v = (struct ZIP_VERIFICATION *)data;
+  if (i<v->n_items) {
+    struct ZIP_VERIFY_ITEM *item = &(v->items[i]);
+    size_t namelen = zip_get16(rec+28);
+    if ( (strlen(item->name) == namelen) &&
+	 (memcmp(item->name,rec+46,namelen) == 0) )
+      item->offset = local_off;
+    else item->failed = "central directory doesn't match libzip";}
+  return 0;
+}
+
+/* Checks the local header of *item* against what the central
+   directory says. Sizes and crcs are only compared when the header
+   has them, rather than a data descriptor or a ZIP64 extra field. AES
+   encrypted entries have method 99 in their headers, with the real
+   method (which libzip reports) in an extra field, and may not have a
+   crc, so only their sizes and names are compared. */
+static int zip_verify_header(struct ZIP_VERIFICATION *v,
+			     struct ZIP_VERIFY_ITEM *item)
+{
+  unsigned char header[30];
+  size_t namelen = strlen(item->name), extralen;
+  unsigned char *name;
+  int aes;
+  if (zip_pread(v->fd,header,30,item->offset) != 30) {
+    item->failed = "local header is missing";
+    return -1;}
+  else if (zip_get32(header) != ZIP_LOCAL_SIG) {
+    item->failed = "bad local header signature";
+    return -1;}
+  aes = ( (item->encrypted) && (zip_get16(header+8) == 99) );
+  if ( ( (!(aes)) && (zip_get16(header+8) != (unsigned int)item->method) ) ||
+       (zip_get16(header+26) != namelen) ) {
+    item->failed = "local header doesn't match central directory";
+    return -1;}
+  extralen = zip_get16(header+28);
+  name = u8_malloc(namelen+1);
+  if ( (zip_pread(v->fd,name,namelen,item->offset+30) !=
+	(ssize_t)namelen) ||
+       (memcmp(name,item->name,namelen) != 0) ) {
+    u8_free(name);
+    item->failed = "local header name doesn't match central directory";
+    return -1;}
+  u8_free(name);
+  if ( (!(zip_get16(header+6)&0x08)) &&
+       ( ( (!(aes)) && (zip_get32(header+14) != item->crc) ) ||
+	 ( (zip_get32(header+18) != 0xFFFFFFFF) &&
+	   (zip_get32(header+18) != item->csize) ) ||
+	 ( (zip_get32(header+22) != 0xFFFFFFFF) &&
+	   (zip_get32(header+22) != item->size) ) ) ) {
+    item->failed = "local header doesn't match central directory";
+    return -1;}
+  if ((item->offset+30+namelen+extralen+item->csize) > v->cd_off) {
+    item->failed = "entry data runs into the central directory";
+    return -1;}
+  return 0;
+}
+
+/* Inflates (or just reads) the raw data of a stored or deflated entry,
+   returning the crc of the content */
+static unsigned int zip_verify_raw(struct ZIP_VERIFICATION *v,
+				   struct ZIP_VERIFY_ITEM *item,
+				   struct zip_file *zfile,
+				   unsigned char *in,unsigned char *out)
+{
+  unsigned int crc = crc32(0L,Z_NULL,0);
+  z_stream zs;
+  int status = Z_OK;
+  if (item->method == ZIP_CM_STORE) {
+    zip_int64_t got;
+    while ((got = zip_fread(zfile,out,v->bufsize))>0) {
+      crc = crc32(crc,out,got);
+      item->bytes += got;}
+    if (got<0) {
+      item->failed = "read error";
+      item->details = u8_strdup(zip_file_strerror(zfile));}
+    return crc;}
+  memset(&zs,0,sizeof(zs));
+  if (inflateInit2(&zs,-MAX_WBITS) != Z_OK) {
+    item->failed = "couldn't start inflating";
+    return crc;}
+  while (status != Z_STREAM_END) {
+    size_t produced;
+    if (zs.avail_in == 0) {
+      zip_int64_t got = zip_fread(zfile,in,v->bufsize);
+      if (got<0) {
+	item->failed = "read error";
+	item->details = u8_strdup(zip_file_strerror(zfile));
+	break;}
+      else if (got == 0) {
+	item->failed = "compressed data is truncated";
+	break;}
+      zs.next_in = in; zs.avail_in = got;}
+    zs.next_out = out; zs.avail_out = v->bufsize;
+    status = inflate(&zs,Z_NO_FLUSH);
+    if ( (status != Z_OK) && (status != Z_STREAM_END) ) {
+      item->failed = "bad compressed data";
+      if (zs.msg) item->details = u8_strdup(zs.msg);
+      break;}
+    produced = v->bufsize-zs.avail_out;
+    crc = crc32(crc,out,produced);
+    item->bytes += produced;}
+  inflateEnd(&zs);
+  return crc;
+}
+
+static void zip_verify_item(struct ZIP_VERIFICATION *v,struct zip *zip,
+			    struct ZIP_VERIFY_ITEM *item,
+			    unsigned char *in,unsigned char *out)
+{
+  struct zip_file *zfile;
+  unsigned int crc;
+  int raw = ( (item->method == ZIP_CM_STORE) ||
+	      (item->method == ZIP_CM_DEFLATE) );
+  if (item->failed) return;
+  else if ( (v->fd>=0) && (item->offset>=0) &&
+	    (zip_verify_header(v,item)<0) )
+    return;
+  else if (item->encrypted) return;
+  zfile = zip_fopen_index(zip,item->index,(raw) ? (ZIP_FL_COMPRESSED) : (0));
+  if (zfile == NULL) {
+    item->failed = "couldn't open entry";
+    item->details = u8_strdup(zip_strerror(zip));
+    return;}
+  if (raw)
+    crc = zip_verify_raw(v,item,zfile,in,out);
   else {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_TRUE;}
+    /* libzip checks the crc itself, failing the last read */
+    zip_int64_t got;
+    crc = crc32(0L,Z_NULL,0);
+    while ((got = zip_fread(zfile,out,v->bufsize))>0) {
+      crc = crc32(crc,out,got);
+      item->bytes += got;}
+    if (got<0) {
+      item->failed = "read error";
+      item->details = u8_strdup(zip_file_strerror(zfile));}}
+  zip_fclose(zfile);
+  if (item->failed) return;
+  else if (item->bytes != item->size) {
+    item->failed = "wrong size";
+    item->details = u8_mkstring("expected %llu bytes, got %llu",
+				item->size,item->bytes);}
+  else if (crc != item->crc) {
+    item->failed = "CRC mismatch";
+    item->details = u8_mkstring("expected %08x, got %08x",item->crc,crc);}
 }
 
+static void zip_verify_worker(long long thread,void *data)
+{
+  struct ZIP_VERIFICATION *v = (struct ZIP_VERIFICATION *)data;
+  struct zip *zip = NULL;
+  unsigned char *in = u8_malloc(v->bufsize), *out = u8_malloc(v->bufsize);
+  long long i;
+  int errflag = 0;
+  if (thread == 0)
+    zip = v->first;
+  else zip = zipfile_open_handle
+	 (v->zipfile,(v->zipfile->flags&(~(ZIP_CHECKCONS|ZIP_CREATE)))|
+	  ZIP_RDONLY,&errflag);
+  /* If this thread can't get a handle, the others do its share */
+  if (zip) {
+    while ((i = __atomic_fetch_add(&(v->next),1,__ATOMIC_RELAXED)) <
+	   v->n_items)
+      zip_verify_item(v,zip,&(v->items[i]),in,out);
+    if (thread != 0) zip_discard(zip);}
+  u8_free(in);
+  u8_free(out);
+}
 
-DEFC_PRIM("zip/modtime",zipmodtime_prim,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+DEFC_PRIM("zip/verify",zipverify_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "checks the crc and size of every entry of *zipfile* (as "
+	  "last committed) and, for archives in files, that each local "
+	  "header agrees with the central directory. Entries are read "
+	  "on `threads` threads (given in *opts*) without keeping "
+	  "their content. This returns a slotmap with the number of "
+	  "`entries`, `failed` and `skipped` (encrypted) entries, the "
+	  "`bytes` checked, their `compressed` size, the `seconds` taken "
+	  "and `throughput` in bytes per second, plus `errors`, a slotmap "
+	  "from names to error messages, if any entries failed.",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID})
-static lispval zipmodtime_prim(lispval zipfile,lispval filename)
+	  {"opts",kno_any_type,KNO_FALSE})
+static lispval zipverify_prim(lispval zipfile,lispval opts)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_string fname = KNO_CSTRING(filename);
-  struct zip_stat zstat; int zret;
-  int index;
-  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  index = zip_name_locate(zf->zip,fname,0);
-  if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_FALSE;}
-  else if ((zret = zip_stat(zf->zip,fname,0,&zstat))) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipmodtime_prim/stat",zf,filename);}
-  else {
-    time_t modified = zstat.mtime;
-    lispval timestamp = kno_time2timestamp(modified);
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return timestamp;}
+  lispval threads_arg = kno_getopt(opts,threads_symbol,KNO_VOID);
+  struct ZIP_VERIFICATION v;
+  lispval result = KNO_VOID, errors = KNO_VOID;
+  long long i = 0, n, n_failed = 0, n_skipped = 0, start = zip_nanotime();
+  unsigned long long bytes = 0, cbytes = 0;
+  double secs;
+  int errflag = 0, n_threads;
+  memset(&v,0,sizeof(v));
+  v.fd = -1;
+  if (KNO_FIXNUMP(threads_arg))
+    n_threads = KNO_FIX2INT(threads_arg);
+  else n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads<1) n_threads = 1;
+  v.zipfile = zf;
+  v.bufsize = (zipstream_bufsize>0) ? (zipstream_bufsize) : (65536);
+  v.first = zipfile_open_handle
+    (zf,(zf->flags&(~(ZIP_CHECKCONS|ZIP_CREATE)))|ZIP_RDONLY,&errflag);
+  if (v.first == NULL) {
+    result = znumerr("zipverify_prim",errflag,zf->filename);
+    goto done;}
+  n = zip_get_num_entries(v.first,0);
+  v.items = u8_alloc_n(((n>0)?(n):(1)),struct ZIP_VERIFY_ITEM);
+  while (i<n) {
+    struct ZIP_VERIFY_ITEM *item = &(v.items[v.n_items++]);
+    struct zip_stat zstat;
+    memset(item,0,sizeof(struct ZIP_VERIFY_ITEM));
+    item->index = i; item->offset = -1;
+    if ( (zip_stat_index(v.first,i,0,&zstat) == 0) &&
+	 (zstat.valid&ZIP_STAT_NAME) ) {
+      item->name = zstat.name;
+      item->size = zstat.size;
+      item->csize = zstat.comp_size;
+      item->crc = zstat.crc;
+      item->method = zstat.comp_method;
+      item->encrypted = (zstat.encryption_method != ZIP_EM_NONE);}
+    else {
+      item->name = "";
+      item->failed = "couldn't stat entry";
+      item->details = u8_strdup(zip_strerror(v.first));}
+    i++;}
+  if (!(zf->inmem)) {
+    struct stat fileinfo;
+    unsigned long long cd_size, cd_count;
+    unsigned char *cdir = NULL;
+    v.fd = open(zf->filename,O_RDONLY);
+    if ( (v.fd>=0) && (fstat(v.fd,&fileinfo) == 0) &&
+	 (zip_find_cdir(v.fd,fileinfo.st_size,
+			&(v.cd_off),&cd_size,&cd_count)>=0) &&
+	 ( (v.cd_off+cd_size) <= ((unsigned long long)fileinfo.st_size) ) ) {
+      cdir = u8_malloc(cd_size+1);
+      if (zip_pread(v.fd,cdir,cd_size,v.cd_off) == (ssize_t)cd_size)
+	zip_walk_cdir(cdir,cd_size,zip_verify_set_offset,&v);
+      u8_free(cdir);}
+    U8_CLEAR_ERRNO();}
+  if (n_threads > v.n_items) n_threads = (v.n_items) ? (v.n_items) : (1);
+  zip_parallel(n_threads,n_threads,zip_verify_worker,&v);
+  i = 0; while (i<v.n_items) {
+    struct ZIP_VERIFY_ITEM *item = &(v.items[i++]);
+    if (item->failed) {
+      u8_string msg = (item->details) ?
+	(u8_mkstring("%s: %s",item->failed,item->details)) :
+	(u8_strdup(item->failed));
+      lispval key = kno_mkstring(item->name);
+      lispval val = kno_wrapstring(msg);
+      if (KNO_VOIDP(errors)) errors = kno_make_slotmap(8,0,NULL);
+      kno_store(errors,key,val);
+      kno_decref(key); kno_decref(val);
+      if (item->details) u8_free(item->details);
+      n_failed++;}
+    else if (item->encrypted)
+      n_skipped++;
+    else {
+      bytes += item->bytes;
+      cbytes += item->csize;}}
+  secs = ((double)(zip_nanotime()-start))/1000000000.0;
+  result = kno_make_slotmap(8,0,NULL);
+  kno_store(result,kno_intern("entries"),KNO_INT2LISP(v.n_items));
+  kno_store(result,kno_intern("failed"),KNO_INT2LISP(n_failed));
+  kno_store(result,kno_intern("skipped"),KNO_INT2LISP(n_skipped));
+  kno_store(result,kno_intern("bytes"),KNO_INT2LISP(bytes));
+  kno_store(result,kno_intern("compressed"),KNO_INT2LISP(cbytes));
+  {
+    lispval seconds = kno_make_flonum(secs);
+    lispval rate = kno_make_flonum((secs>0) ? (bytes/secs) : (0.0));
+    kno_store(result,kno_intern("seconds"),seconds);
+    kno_store(result,kno_intern("throughput"),rate);
+    kno_decref(seconds);
+    kno_decref(rate);
+  }
+  if (!(KNO_VOIDP(errors))) {
+    kno_store(result,kno_intern("errors"),errors);
+    kno_decref(errors);}
+ done:
+  if (v.fd>=0) close(v.fd);
+  if (v.first) zip_discard(v.first);
+  if (v.items) u8_free(v.items);
+  kno_decref(threads_arg);
+  return result;
 }
 
+/* Cache control */
 
-DEFC_PRIM("zip/getsize",zipgetsize_prim,
+DEFC_PRIM("zip/cache!",zipcache_prim,
 	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+	  "sets the number of bytes of decoded content cached for "
+	  "*zipfile*. #f or 0 turns the cache off and empties it.",
 	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID})
-static lispval zipgetsize_prim(lispval zipfile,lispval filename)
+	  {"budget",kno_any_type,KNO_VOID})
+static lispval zipcache_prim(lispval zipfile,lispval budget)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_string fname = KNO_CSTRING(filename);
-  struct zip_stat zstat; int zret;
-  int index;
-  if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  index = zip_name_locate(zf->zip,fname,0);
-  if (index<0) {
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return KNO_FALSE;}
-  else if ((zret = zip_stat(zf->zip,fname,0,&zstat))) {
+  struct KNO_ZIPCACHE *cache;
+  long long bytes = (KNO_FALSEP(budget)) ? (0) :
+    (KNO_FIXNUMP(budget)) ? (KNO_FIX2INT(budget)) : (-1);
+  if (bytes<0)
+    return kno_type_error("byte count","zipcache_prim",budget);
+  zipfile_lock(zf);
+  if (zf->cache == NULL) {
+    if (bytes) zf->cache = make_zipcache(bytes);
     u8_unlock_mutex(&(zf->zipfile_lock));
-    return ziperr("zipgetsize_prim/stat",zf,filename);}
-  else {
-    size_t uncompressed_size = zstat.size;
-    lispval size = KNO_INT2LISP(uncompressed_size);
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return size;}
+    return KNO_TRUE;}
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  /* The cache itself is never freed while the zipfile is live, since
+     readers use it without the zipfile lock */
+  cache = zf->cache;
+  u8_lock_mutex(&(cache->cache_lock));
+  cache->budget = bytes;
+  while ( (cache->oldest) && (cache->used > cache->budget) ) {
+    zipcache_remove(cache,cache->oldest);
+    cache->evictions++;}
+  u8_unlock_mutex(&(cache->cache_lock));
+  return KNO_TRUE;
 }
 
-
-DEFC_PRIM("zip/getfiles",zipgetfiles_prim,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID})
-static lispval zipgetfiles_prim(lispval zipfile)
+DEFC_PRIM("zip/cache-stats",zipcachestats_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "returns the cache statistics for *zipfile*: its budget, the "
+	  "bytes used, entries, hits, misses and evictions, entries "
+	  "prefetched and reads which waited for a prefetch, or #f if it "
+	  "isn't caching. If *reset* is true, the counters are zeroed.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"reset",kno_any_type,KNO_FALSE})
+static lispval zipcachestats_prim(lispval zipfile,lispval reset)
 {
   struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
-  u8_lock_mutex(&(zf->zipfile_lock));
-  if (zf->closed) {
-    lispval errval = zipreopen(zf,1);
-    if (KNO_ABORTP(errval)) {
-      u8_unlock_mutex(&(zf->zipfile_lock));
-      return errval;}}
-  {
-    lispval files = KNO_EMPTY_CHOICE;
-    int numfiles = zip_get_num_files(zf->zip);
-    int i = 0; while (i<numfiles) {
-      u8_string name = (u8_string)zip_get_name(zf->zip,i,0);
-      if (!(name)) i++;
-      else {
-	lispval lname = kno_mkstring(name);
-	KNO_ADD_TO_CHOICE(files,lname);
-	i++;}}
-    u8_unlock_mutex(&(zf->zipfile_lock));
-    return files;}
+  struct KNO_ZIPCACHE *cache = zf->cache;
+  lispval result;
+  if (cache == NULL) return KNO_FALSE;
+  result = kno_make_slotmap(8,0,NULL);
+  u8_lock_mutex(&(cache->cache_lock));
+  kno_store(result,budget_symbol,KNO_INT2LISP(cache->budget));
+  kno_store(result,kno_intern("used"),KNO_INT2LISP(cache->used));
+  kno_store(result,kno_intern("entries"),KNO_INT2LISP(cache->n_entries));
+  kno_store(result,kno_intern("hits"),KNO_INT2LISP(cache->hits));
+  kno_store(result,kno_intern("misses"),KNO_INT2LISP(cache->misses));
+  kno_store(result,kno_intern("evictions"),KNO_INT2LISP(cache->evictions));
+  kno_store(result,kno_intern("prefetches"),KNO_INT2LISP(cache->prefetches));
+  kno_store(result,kno_intern("waits"),KNO_INT2LISP(cache->waits));
+  if (KNO_TRUEP(reset)) {
+    cache->hits = cache->misses = cache->evictions = 0;
+    cache->prefetches = cache->waits = 0;}
+  u8_unlock_mutex(&(cache->cache_lock));
+  return result;
+}
+
+/* Reads a counter, zeroing it if *reset*. Other threads update the
+   counters with relaxed atomics, so each one is read (and reset)
+   atomically rather than under a lock. */
+static long long zipstats_take(long long *counter,int reset)
+{
+  if (reset) return __atomic_exchange_n(counter,0,__ATOMIC_RELAXED);
+  else return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
+
+static lispval zip_histogram_table(struct ZIP_HISTOGRAM *from,int reset)
+{
+  lispval table = kno_make_slotmap(4,0,NULL), buckets;
+  struct ZIP_HISTOGRAM snapshot, *h = &snapshot;
+  int i = 0, n_buckets = 0;
+  snapshot.count = zipstats_take(&(from->count),reset);
+  snapshot.total = zipstats_take(&(from->total),reset);
+  while (i<ZIPSTATS_BUCKETS) {
+    snapshot.buckets[i] = zipstats_take(&(from->buckets[i]),reset);
+    i++;}
+  i = 0; while (i<ZIPSTATS_BUCKETS) {
+    if (h->buckets[i]) n_buckets = i+1;
+    i++;}
+  buckets = kno_make_vector(n_buckets,NULL);
+  i = 0; while (i<n_buckets) {
+    KNO_VECTOR_SET(buckets,i,KNO_INT2LISP(h->buckets[i]));
+    i++;}
+  kno_store(table,count_symbol,KNO_INT2LISP(h->count));
+  kno_store(table,kno_intern("total"),KNO_INT2LISP(h->total));
+  kno_store(table,kno_intern("mean"),
+	    KNO_INT2LISP((h->count) ? (h->total/h->count) : (0)));
+  kno_store(table,kno_intern("histogram"),buckets);
+  kno_decref(buckets);
+  return table;
+}
+
+static void zipstats_store(lispval table,u8_string name,lispval value)
+{
+  lispval slotid = kno_intern(name);
+  kno_store(table,slotid,value);
+  kno_decref(value);
+}
+
+DEFC_PRIM("zip/stats",zipstats_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(0),
+	  "returns statistics for *zipfile* (or for all zipfiles if "
+	  "it's #f): counts of gets, adds, reopens and commits, bytes "
+	  "read from the archive and produced, bytes added, added "
+	  "entries (and their bytes) which weren't compressed again "
+	  "because of `dedup`, and timings "
+	  "(in nanoseconds) of lock waits, lookups, decompression and "
+	  "commits. Each timing has a histogram whose element *i* counts "
+	  "durations under 2^i nanoseconds. If *reset* is true, the "
+	  "statistics are zeroed. Collection is controlled by the "
+	  "ZIPSTATS config.",
+	  {"zipfile",kno_any_type,KNO_FALSE},
+	  {"reset",kno_any_type,KNO_FALSE})
+static lispval zipstats_prim(lispval zipfile,lispval resetarg)
+{
+  struct KNO_ZIPSTATS *stats;
+  int reset = (!(KNO_FALSEP(resetarg)));
+  lispval result;
+  if ( (KNO_FALSEP(zipfile)) || (KNO_VOIDP(zipfile)) )
+    stats = &zipstats_all;
+  else if (KNO_TYPEP(zipfile,kno_zipfile_type)) {
+    struct KNO_ZIPFILE *zf =
+      kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+    stats = &(zf->stats);}
+  else return kno_type_error("zipfile","zipstats_prim",zipfile);
+  result = kno_make_slotmap(14,0,NULL);
+  zipstats_store(result,"gets",
+		 KNO_INT2LISP(zipstats_take(&(stats->gets),reset)));
+  zipstats_store(result,"bytes-in",
+		 KNO_INT2LISP(zipstats_take(&(stats->bytes_in),reset)));
+  zipstats_store(result,"bytes-out",
+		 KNO_INT2LISP(zipstats_take(&(stats->bytes_out),reset)));
+  zipstats_store(result,"adds",
+		 KNO_INT2LISP(zipstats_take(&(stats->adds),reset)));
+  zipstats_store(result,"bytes-added",
+		 KNO_INT2LISP(zipstats_take(&(stats->bytes_added),reset)));
+  zipstats_store(result,"dedups",
+		 KNO_INT2LISP(zipstats_take(&(stats->dedups),reset)));
+  zipstats_store(result,"bytes-deduped",
+		 KNO_INT2LISP(zipstats_take(&(stats->bytes_deduped),reset)));
+  zipstats_store(result,"reopens",
+		 KNO_INT2LISP(zipstats_take(&(stats->reopens),reset)));
+  zipstats_store(result,"commits",
+		 KNO_INT2LISP(zipstats_take(&(stats->commits),reset)));
+  zipstats_store(result,"lockwait",
+		 zip_histogram_table(&(stats->timers[ZIPSTAT_LOCKWAIT]),reset));
+  zipstats_store(result,"lookup",
+		 zip_histogram_table(&(stats->timers[ZIPSTAT_LOOKUP]),reset));
+  zipstats_store(result,"decompress",
+		 zip_histogram_table(&(stats->timers[ZIPSTAT_DECOMPRESS]),reset));
+  zipstats_store(result,"commit",
+		 zip_histogram_table(&(stats->timers[ZIPSTAT_COMMIT]),reset));
+  return result;
 }
 
+DEFC_PRIM("zip/autostored",zipautostored_prim,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "returns the compression method (store or deflate) chosen "
+	  "automatically for *filename* in *zipfile*, or #f if it "
+	  "wasn't added with the `auto` method. Without *filename*, "
+	  "returns a table of all the automatic choices.",
+	  {"zipfile",KNO_ZIPFILE_TYPE,KNO_VOID},
+	  {"filename",kno_any_type,KNO_VOID})
+static lispval zipautostored_prim(lispval zipfile,lispval filename)
+{
+  struct KNO_ZIPFILE *zf = kno_consptr(kno_zipfile,zipfile,kno_zipfile_type);
+  lispval result;
+  if ( (!(KNO_VOIDP(filename))) && (!(KNO_STRINGP(filename))) )
+    return kno_type_error("string","zipautostored_prim",filename);
+  zipfile_lock(zf);
+  if (KNO_STRINGP(filename)) {
+    if (KNO_EMPTYP(zf->autochoices))
+      result = KNO_FALSE;
+    else {
+      result = kno_get(zf->autochoices,filename,KNO_FALSE);
+      if (KNO_EMPTYP(result)) result = KNO_FALSE;}}
+  else {
+    result = kno_make_slotmap(8,0,NULL);
+    if (!(KNO_EMPTYP(zf->autochoices))) {
+      lispval keys = kno_getkeys(zf->autochoices);
+      KNO_DO_CHOICES(key,keys) {
+	lispval method = kno_get(zf->autochoices,key,KNO_VOID);
+	kno_store(result,key,method);
+	kno_decref(method);}
+      kno_decref(keys);}}
+  u8_unlock_mutex(&(zf->zipfile_lock));
+  return result;
+}
 
 DEFC_PRIM("zip/features",zipfeatures_prim,
 	  KNO_MAX_ARGS(0)|KNO_MIN_ARGS(0),
@@ -534,6 +5033,14 @@ static lispval zipfeatures_prim()
 #if (HAVE_ZIP_SET_FILE_COMPRESSION)
   KNO_ADD_TO_CHOICE(result,kno_intern("compression"));
 #endif
+  {
+    struct ZIP_COMPRESSOR *scan = zip_compressors;
+    while (scan->name) {
+      if (zip_method_supportedp(scan->method)) {
+	lispval codec = kno_intern(scan->name);
+	KNO_ADD_TO_CHOICE(result,codec);}
+      scan++;}
+  }
   return result;
 }
 
@@ -558,7 +5065,7 @@ static lispval zip_gpath_handler(lispval zipfile,lispval path,lispval aspect,lis
     struct zip_file *zfile = NULL;
     int index;
     if ((fname[0]=='.')&&(fname[1]=='/')) fname = fname+2;
-    u8_lock_mutex(&(zf->zipfile_lock));
+    zipfile_lock(zf);
     if (zf->closed) {
       lispval errval = zipreopen(zf,1);
       if (KNO_ABORTP(errval)) {
@@ -598,16 +5105,90 @@ KNO_EXPORT int kno_init_ziptools()
   if (ziptools_init) return 0;
 
   ziptools_init = u8_millitime();
+  u8_init_mutex(&zipshared_lock);
+  u8_init_mutex(&zip_prefetch_lock);
+  u8_init_condvar(&zip_prefetch_ready);
   ziptools_module =
     kno_new_cmodule("ziptools",0,kno_init_ziptools);
 
   kno_zipfile_type = kno_register_cons_type("ZIPFILE",KNO_ZIPFILE_TYPE);
 
+  kno_zipstream_type =
+    kno_register_cons_type("ZIPSTREAM",KNO_ZIPSTREAM_TYPE);
+
+#if ZIP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) skip_ascii = skip_ascii_avx2;
+#endif
+
   kno_store(ziptools_module,kno_intern("zipfile-type"),
 	    KNO_CTYPE(kno_zipfile_type));
+  kno_store(ziptools_module,kno_intern("zipstream-type"),
+	    KNO_CTYPE(kno_zipstream_type));
+
+  create_symbol = kno_intern("create");
+  readonly_symbol = kno_intern("readonly");
+  readers_symbol = kno_intern("readers");
+  text_symbol = kno_intern("text");
+  bufsize_symbol = kno_intern("bufsize");
+  threads_symbol = kno_intern("threads");
+  cache_symbol = kno_intern("cache");
+  budget_symbol = kno_intern("budget");
+  autostore_symbol = kno_intern("autostore");
+  store_symbol = kno_intern("store");
+  deflate_symbol = kno_intern("deflate");
+  prefix_symbol = kno_intern("prefix");
+  glob_symbol = kno_intern("glob");
+  columns_symbol = kno_intern("columns");
+  count_symbol = kno_intern("count");
+  start_symbol = kno_intern("start");
+  limit_symbol = kno_intern("limit");
+  append_symbol = kno_intern("append");
+  skip_symbol = kno_intern("skip");
+  include_symbol = kno_intern("include");
+  exclude_symbol = kno_intern("exclude");
+  shared_symbol = kno_intern("shared");
+  nocheck_symbol = kno_intern("nocheck");
+  lazy_symbol = kno_intern("lazy");
+  dedup_symbol = kno_intern("dedup");
 
   kno_unparsers[kno_zipfile_type]=unparse_zipfile;
   kno_recyclers[kno_zipfile_type]=recycle_zipfile;
+  kno_unparsers[kno_zipstream_type]=unparse_zipstream;
+  kno_recyclers[kno_zipstream_type]=recycle_zipstream;
+
+  kno_register_config
+    ("ZIPTHREADS",
+     "Number of threads used to compress added entries when committing",
+     kno_intconfig_get,kno_intconfig_set,&zipfile_commit_threads);
+  kno_register_config
+    ("ZIPCACHE",
+     "Default byte budget for caching decoded entries of new zipfiles",
+     kno_sizeconfig_get,kno_sizeconfig_set,&zipfile_cache_budget);
+  kno_register_config
+    ("ZIPSHARED",
+     "Whether read-only zipfiles are shared between zip/open calls",
+     kno_boolconfig_get,kno_boolconfig_set,&zipfile_shared);
+  kno_register_config
+    ("ZIPSTATS",
+     "Whether to collect zipfile statistics (see zip/stats)",
+     kno_boolconfig_get,kno_boolconfig_set,&zipfile_stats);
+  kno_register_config
+    ("ZIPAUTOSTORE",
+     "Whether new zipfiles store incompressible-looking entries by default",
+     kno_boolconfig_get,kno_boolconfig_set,&zipfile_autostore);
+  kno_register_config
+    ("ZIPDEDUP",
+     "Whether new zipfiles compress identical added content only once",
+     kno_boolconfig_get,kno_boolconfig_set,&zipfile_dedup);
+  kno_register_config
+    ("ZIPREADERS",
+     "Maximum number of idle read handles kept for read-only zipfiles",
+     kno_intconfig_get,kno_intconfig_set,&zipfile_max_readers);
+  kno_register_config
+    ("ZIPPREFETCH",
+     "Maximum number of background threads used by zip/prefetch",
+     kno_intconfig_get,kno_intconfig_set,&zipfile_prefetch_threads);
 
   link_local_cprims();
 
@@ -626,17 +5207,40 @@ static void link_local_cprims()
 
   KNO_LINK_CPRIM("zip/make",zipmake_prim,1,ziptools_module);
   KNO_LINK_CPRIM("zip/open",zipopen_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/unshare!",zipunshare_prim,1,ziptools_module);
+  KNO_LINK_CPRIM("zip/open-packet",zipopenpacket_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/make-packet",zipmakepacket_prim,1,ziptools_module);
   KNO_LINK_CPRIM("zipfile?",iszipfile_prim,1,ziptools_module);
 
   KNO_LINK_CPRIM("zip/open?",zipfile_openp,1,ziptools_module);
 
   KNO_LINK_CPRIM("zip/add!",zipadd_prim,5,ziptools_module);
+  KNO_LINK_CPRIM("zip/add-file!",zipaddfile_prim,5,ziptools_module);
+  KNO_LINK_CPRIM("zip/add-many!",zipaddmany_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/copy-entry!",zipcopyentry_prim,4,ziptools_module);
+  KNO_LINK_CPRIM("zip/merge!",zipmerge_prim,3,ziptools_module);
 
   KNO_LINK_CPRIM("zip/drop!",zipdrop_prim,2,ziptools_module);
   KNO_LINK_CPRIM("zip/get",zipget_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/get-many",zipgetmany_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/prefetch",zipprefetch_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/cache!",zipcache_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/cache-stats",zipcachestats_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/autostored",zipautostored_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/stats",zipstats_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/open-entry",zipopenentry_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/read",zipread_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/seek!",zipseek_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/tell",ziptell_prim,1,ziptools_module);
+  KNO_LINK_CPRIM("zip/close-entry!",zipcloseentry_prim,1,ziptools_module);
+  KNO_LINK_CPRIM("zip/extract-all",zipextractall_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/verify",zipverify_prim,2,ziptools_module);
 
   KNO_LINK_CPRIM("zip/filename",zipfilename_prim,1,ziptools_module);
   KNO_LINK_CPRIM("zip/getfiles",zipgetfiles_prim,1,ziptools_module);
+  KNO_LINK_CPRIM("zip/entries",zipentries_prim,2,ziptools_module);
+  KNO_LINK_CPRIM("zip/list-dir",ziplistdir_prim,3,ziptools_module);
+  KNO_LINK_CPRIM("zip/count-prefix",zipcountprefix_prim,2,ziptools_module);
   KNO_LINK_CPRIM("zip/getsize",zipgetsize_prim,2,ziptools_module);
   KNO_LINK_CPRIM("zip/modtime",zipmodtime_prim,2,ziptools_module);
   KNO_LINK_CPRIM("zip/exists?",zipexists_prim,2,ziptools_module);